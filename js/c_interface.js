@@ -10,10 +10,8 @@ fileSelector.addEventListener('change', (event) => {
     const fileList = event.target.files;
     var fileReader = new FileReader();
     fileReader.onload = function (event) {
-        var arrayBuffer = event.target.result;
-        var bytes = new Uint8Array(arrayBuffer);
-
-        open_success(bytes.toString());
+        $("#file-selector").hide();
+        open_success(new Uint8Array(event.target.result));
     }
     fileReader.readAsArrayBuffer(fileList[0]);
 });
@@ -25,7 +23,10 @@ function read(success) {
 };
 
 
+// Shows the file selector, success gets the file's bytes
 function open_file(success) {
+    $("#file-selector").show();
+    $("#output").val($("#output").val() + "Please Upload a File\n");
     open_success = success;
 };
 
@@ -86,10 +87,51 @@ document.addEventListener('keyup', (e) => {
 }, false);
 
 
-function emscripten_sleep(ms) {
-    Asyncify.handleSleep(function (wakeUp) {
-        setTimeout(wakeUp, ms);
-    });
+// Commands from the emulator, see bridge.h
+const HOST_START = 0x1;
+const HOST_VIDEO_MODE = 0x2;
+const HOST_BACKGROUND = 0x3;
+const HOST_WRITE = 0x5;
+
+// Runs a batch of commands the emulator queued, second holds the rest when they wrapped around its queue
+function handle_commands(first, second) {
+    let bytes = first;
+
+    if (second.length > 0) {
+        bytes = new Uint8Array(first.length + second.length);
+        bytes.set(first);
+        bytes.set(second, first.length);
+    }
+
+    let i = 0;
+
+    while (i < bytes.length) {
+        switch (bytes[i++]) {
+            case HOST_START:
+                video_mode = false;
+                console.log("program started");
+                $("#viewport").show();
+                break;
+            case HOST_VIDEO_MODE:
+                video_mode = true;
+                break;
+            case HOST_BACKGROUND:
+                i += 1;
+                context = canvas.getContext("2d");
+                context.fillStyle = "black";
+                context.fillRect(0, 0, w, h);
+                context.fill();
+                break;
+            // The emulator draws program output on the text screen, the stream is for hosts without a display
+            case HOST_WRITE:
+                i += 2 + (bytes[i] | (bytes[i + 1] << 8));
+                break;
+            default:
+                console.log("Unknown command from the emulator: " + bytes[i - 1]);
+                i = bytes.length;
+                break;
+        }
+    }
 }
 
 var re = /^___emulator::/;
@@ -131,17 +173,6 @@ window.XMLHttpRequest = (function (xhr) {
                                     }
                                 );
                             }
-                            else if (payload[1] == 'open_file') {
-                                $("#file-selector").show();
-                                $("#output").val($("#output").val() + "Please Upload a File\n");
-                                open_file(
-                                    function (text) {
-                                        $("#file-selector").hide();
-                                        props.responseText = text;
-                                        target.onload();
-                                    }
-                                );
-                            }
                             else if (payload[1] == 'get_char') {
                                 console.log("get_char");
                                 get_char(
@@ -159,64 +190,6 @@ window.XMLHttpRequest = (function (xhr) {
                                     }
                                 );
                             }
-                            else if (payload[1] == 'write') {
-                                if (video_mode) {
-                                    context.font = "20px Comic Sans MS";
-                                    context.fillStyle = "red";
-                                    context.fillText(payload[2], Number(payload[3]) * 15, Number(payload[4]) * 10);
-                                }
-                                else {
-                                    $("#program_output").val($("#program_output").val() + payload[2]);
-                                }
-
-                            }
-                            else if (payload[1] == 'activate_video_mode') {
-                                video_mode = true;
-                                $("#viewport").show();
-                                $("#program_output").hide();
-                                // context.save();
-
-                            }
-                            else if (payload[1] == 'start') {
-                                video_mode = false;
-                                console.log("program started");
-                                $("#program_output").val("Program Output:\n");
-                                $("#viewport").hide();
-                                $("#program_output").show();
-
-                                // for (let i = 0; i < w; i++) {
-                                //     for (let j = 0; j < h; j++) {
-                                //         drawPixel(imagedata, i, j, colors[0xf]);
-                                //     }
-                                // }
-                                // context.putImageData(imagedata, 0, 0);
-
-                                
-
-                            }
-                            else if (payload[1] == 'set_background_color') {
-                                // for (let i = 0; i < w; i++) {
-                                //     for (let j = 0; j < h; j++) {
-                                //         drawPixel(imagedata, i, j, colors[Number(payload[2])]);
-                                //     }
-                                // }
-                                context = canvas.getContext("2d");
-                                context.fillStyle = "black";
-                                context.fillRect(0, 0, w, h);
-                                context.fill();
-
-                            }
-                            else if (payload[1] == 'draw_pixel') {
-                                let col = Number(payload[3]) * 2;
-                                let row = Number(payload[4]) * 2;
-
-                                // for (let i = 0; i < 2; i++)
-                                //     for (let j = 0; j < 2; j++)
-                                        drawPixel(context, col, row, colors[Number(payload[2])]);
-
-                                // context.putImageData(imagedata, 0, 0);
-                            }
-
                         } else {
                             return target[name].apply(target, arguments);
                         }
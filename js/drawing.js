@@ -63,14 +63,6 @@ class Color {
 //     }
 // } // end drawPixel
 
-function drawPixel(context, x, y, color)
-{
-    context.beginPath();
-    context.fillStyle = color || '#000';
-    context.fillRect(x, y, 2, 2);
-    context.fill();
-}
-
 var canvas = document.getElementById("viewport");
 var context = canvas.getContext("2d");
 var w = context.canvas.width; // as set in html
@@ -82,11 +74,13 @@ var imagedata = context.createImageData(w, h);
 //     0xf: new Color(255, 255, 255, 255)
 // }
 
-var colors = {
-    0x0: 'black',
-    0xf: 'white'
-}
 
 
 
-// context.save();
\ No newline at end of file
+// context.save();
+
+// Draws a run of changed rows of the 640x400 display, the emulator already converted them to RGBA
+function present_rows(rgba, first_row, row_count)
+{
+    context.putImageData(new ImageData(rgba, w, row_count), 0, first_row);
+}
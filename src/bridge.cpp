@@ -1,6 +1,8 @@
 #include "bridge.h"
+#include <emscripten.h>
+#include <emscripten/fetch.h>
 #include <stdlib.h>
-#include <string>
+#include <string.h>
 
 // Data for the file we read in
 char *file_data;
@@ -8,143 +10,94 @@ char *file_data;
 // Bool for whether or not we have read the file
 bool file_ready;
 
-// Function that gets run if we were able to get the file
-void get_file_success(emscripten_fetch_t *fetch)
-{
-
-    // File gets sent in with the format:
-    // 77,88,99
-    // So we will have one number that doesn't have the comma so start with 1
-    int len = 1;
-
-    // Loop through the data and see how many ','s we have
-    for (int i = 0; i < fetch->numBytes; i++)
-    {
-        if (fetch->data[i] == '\x2c')
-            len++;
-    }
-
-    // malloc enough space for all the bytes in the file
-    file_data = (char *)malloc(sizeof(char) * (len));
-
-    // Create an empty array of 4 chars, will use this to convert 
-    // the numbers back into chars
-    char *converter = (char *)calloc(4, sizeof(char));
-
-    // Initialize the two counts
-    int data_count = 0;
-    int converter_count = 0;
-
-    // This loop splits on ',' and converts numbers to char
-    for (int i = 0; i < fetch->numBytes; i++)
-    {
-        // If the current character is a ','
-        if (fetch->data[i] == '\x2c')
-        {
-            // Set the converter value to null terminator
-            converter[converter_count] = '\0';
-
-            // reset converter count
-            converter_count = 0;
-
-            // Add the char to the file_data
-            file_data[data_count++] = (char)atoi(converter);
-        }
-        else
-        {
-            // Otherwise we add the value to our converter
-            converter[converter_count++] = fetch->data[i];
-        }
-    }
-
-    // Get the last data value
-    converter[converter_count] = '\0';
-    file_data[data_count++] = (char)atoi(converter);
-
-    // Set file_ready to true so our program can continue
-    file_ready = true;
+// Function the frontend calls with the uploaded file, already copied into a buffer from malloc
+extern "C" EMSCRIPTEN_KEEPALIVE void file_uploaded(char *data, int size)
+{
+    file_data = data;
 
-    // Close fetch
-    emscripten_fetch_close(fetch);
+    // Set file_ready to true so the program can start
+    file_ready = true;
 }
 
-// Function that gets run if we were unable to get the file
-void get_file_fail(emscripten_fetch_t *fetch)
-{
-    // Close fetch
-    emscripten_fetch_close(fetch);
-}
+// Has the frontend show the file selector, the file's bytes are copied straight into the
+// wasm heap and handed to file_uploaded
+EM_JS(void, frontend_open_file, (), {
+    open_file(function (bytes) {
+        var data = _malloc(bytes.length);
 
-// Try to get the file from the frontend
-char *get_file_async()
+        HEAPU8.set(bytes, data);
+        _file_uploaded(data, bytes.length);
+    });
+});
+
+// Ask the frontend for a file, take_file returns it once it has been uploaded
+void request_file()
 {
-    // Set file_ready to false so we can block later
+    // Set file_ready to false until the upload arrives
     file_ready = false;
 
-    // Declare and initialize our attribute
-    emscripten_fetch_attr_t attr;
-    emscripten_fetch_attr_init(&attr);
-
-    // Set the request method to get
-    strcpy(attr.requestMethod, "GET");
-
-    // Set attribute
-    attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
-
-    // Set success and error functions
-    attr.onsuccess = get_file_success;
-    attr.onerror = get_file_fail;
-
-    // Fetch the data using the open_file method
-    emscripten_fetch(&attr, "___emulator::open_file");
+    frontend_open_file();
+}
 
-    // While our data isn't ready do our non-blocking block
-    while (!file_ready)
-    {
-        // Non blocking block for 100 ms
-        emscripten_sleep(100);
-    }
+// Returns the requested file, or NULL while it hasn't arrived yet
+char *take_file()
+{
+    if (!file_ready)
+        return NULL;
 
-    // Return file data
+    file_ready = false;
     return file_data;
 }
 
+// Data the frontend sent back for a read or a character request
+typedef struct FETCH_RESULT
+{
+    char *data; // Response with a newline and string terminator appended
+    bool ready; // Set when the response arrived and hasn't been taken yet
+    bool sent;  // Set from the request until the response is taken
+} FETCH_RESULT;
 
-// char pointer for the data we get from the frontend
-char *read_data;
-
-// boolean to see if we have gotten the data
-bool ready;
+FETCH_RESULT line_result;
+FETCH_RESULT char_result;
+FETCH_RESULT held_key_result;
 
 // Function that gets called if we successfully received data
 void read_success(emscripten_fetch_t *fetch)
 {
-    if (read_data)
-        free(read_data);
+    FETCH_RESULT *result = (FETCH_RESULT *)fetch->userData;
+
+    if (result->data)
+        free(result->data);
 
-    read_data = (char *)malloc(sizeof(char) * (fetch->numBytes + 1));
+    result->data = (char *)malloc(sizeof(char) * (fetch->numBytes + 1));
 
-    memcpy(read_data, fetch->data, fetch->numBytes);
+    memcpy(result->data, fetch->data, fetch->numBytes);
 
     // append a newline and string terminator, this is for command parsing
-    read_data[fetch->numBytes - 1] = '\n';
-    read_data[fetch->numBytes] = '\0';
+    result->data[fetch->numBytes - 1] = '\n';
+    result->data[fetch->numBytes] = '\0';
 
-    ready = true;
+    result->ready = true;
     emscripten_fetch_close(fetch);
 }
 
-// function that gets called on failure
+// function that gets called on failure, the request can be sent again
 void read_fail(emscripten_fetch_t *fetch)
 {
+    FETCH_RESULT *result = (FETCH_RESULT *)fetch->userData;
+
+    result->sent = false;
     emscripten_fetch_close(fetch);
 }
 
-// read data from the frontend
-char *read_async()
+// send a GET for a method of the frontend unless the last one is still unanswered
+void request_data(FETCH_RESULT *result, const char *url)
 {
+    if (result->sent)
+        return;
 
-    ready = false;
+    result->ready = false;
+    result->sent = true;
 
     emscripten_fetch_attr_t attr;
     emscripten_fetch_attr_init(&attr);
@@ -152,74 +105,87 @@ char *read_async()
     attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
     attr.onsuccess = read_success;
     attr.onerror = read_fail;
-    emscripten_fetch(&attr, "___emulator::read");
+    attr.userData = result;
+    emscripten_fetch(&attr, url);
+}
 
-    while (!ready)
-    {
-        emscripten_sleep(50);
-    }
+// returns the response to a request, or NULL while it hasn't arrived yet
+char *take_data(FETCH_RESULT *result)
+{
+    if (!result->ready)
+        return NULL;
 
-    return read_data;
+    result->ready = false;
+    result->sent = false;
+    return result->data;
 }
 
-// get a character from the frontend
-char get_char_async(bool wait)
+// ask the frontend for a line of input
+void request_line()
 {
-    ready = false;
-
-    emscripten_fetch_attr_t attr;
-    emscripten_fetch_attr_init(&attr);
-    strcpy(attr.requestMethod, "GET");
-    attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
-    attr.onsuccess = read_success;
-    attr.onerror = read_fail;
-    if (wait)
-    {
-        emscripten_fetch(&attr, "___emulator::get_char_now");
-    }
-    else
-    {
-        emscripten_fetch(&attr, "___emulator::get_char");
-    }
-
-    while (!ready)
-    {
-        emscripten_sleep(50);
-    }
-
-    return read_data[0];
+    request_data(&line_result, "___emulator::read");
 }
 
-// send a message and a character to the frontend
-void send_ping_and_char_async(char *command, char c)
+// returns the line the user entered, or NULL while they are still typing
+char *take_line()
 {
-    emscripten_fetch_attr_t attr;
-    emscripten_fetch_attr_init(&attr);
-    strcpy(attr.requestMethod, "POST");
-    attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
+    return take_data(&line_result);
+}
 
-    std::string url("___emulator::");
+// ask the frontend for the next key the user types
+void request_char()
+{
+    request_data(&char_result, "___emulator::get_char");
+}
 
-    url.append(command);
+// returns true and sets c once the user typed a key
+bool take_char(char *c)
+{
+    char *data = take_data(&char_result);
 
-    url.append("::");
+    if (data == NULL)
+        return false;
 
-    url.append(1, c);
+    *c = data[0];
+    return true;
+}
 
-    emscripten_fetch(&attr, url.c_str());
+// ask the frontend which key is held down right now
+void request_held_key()
+{
+    request_data(&held_key_result, "___emulator::get_char_now");
 }
 
-// send a message to the frontend
-void send_ping_async(char *command)
+// returns true and sets c, 0 when no key is held, once the frontend answered
+bool take_held_key(char *c)
 {
-    emscripten_fetch_attr_t attr;
-    emscripten_fetch_attr_init(&attr);
-    strcpy(attr.requestMethod, "POST");
-    attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
+    char *data = take_data(&held_key_result);
+
+    if (data == NULL)
+        return false;
 
-    std::string url("___emulator::");
+    *c = data[0];
+    return true;
+}
 
-    url.append(command);
+// hand the frontend a batch of commands, it reads them straight out of the wasm heap
+EM_JS(void, frontend_commands, (const unsigned char *first, int first_size, const unsigned char *second, int second_size), {
+    handle_commands(HEAPU8.subarray(first, first + first_size), HEAPU8.subarray(second, second + second_size));
+});
 
-    emscripten_fetch(&attr, url.c_str());
-}
\ No newline at end of file
+// send the commands the emulator queued to the frontend
+void send_commands(const unsigned char *first, int first_size, const unsigned char *second, int second_size)
+{
+    frontend_commands(first, first_size, second, second_size);
+}
+
+// hand the frontend changed rows, the canvas is drawn straight from the wasm heap
+EM_JS(void, frontend_present_rows, (const unsigned int *rgba, int first_row, int row_count), {
+    present_rows(new Uint8ClampedArray(HEAPU8.buffer, rgba, row_count * 640 * 4), first_row, row_count);
+});
+
+// show the rows of the emulated display that changed
+void present_rows(const unsigned int *rgba, int first_row, int row_count)
+{
+    frontend_present_rows(rgba, first_row, row_count);
+}
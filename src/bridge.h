@@ -1,8 +1,24 @@
 #pragma once
-#include <emscripten/fetch.h>
 
-char *get_file_async();
-char *read_async();
-char get_char_async(bool wait = false);
-void send_ping_and_char_async(char *command, char c);
-void send_ping_async(char *command);
\ No newline at end of file
+// Commands the emulator sends the host, each is the byte below followed by its operands.
+// Words are little endian
+#define HOST_START 0x1      // A program was loaded
+#define HOST_VIDEO_MODE 0x2 // Graphics mode was set
+#define HOST_BACKGROUND 0x3 // color byte: Clear the screen
+#define HOST_WRITE 0x5      // length word, text: Program output
+
+// Host side of the emulator. bridge.cpp talks to the browser frontend, headless_bridge.cpp
+// to stdin and stdout for native builds. Requests return right away, the take functions
+// hand back the answer once it arrived. Output is queued by the emulator and handed over with
+// send_commands, the second part is the rest of the commands when they wrapped around the queue.
+// present_rows gets a run of changed rows of the 640x400 display, RGBA bytes in memory order
+void request_file();
+char *take_file();
+void request_line();
+char *take_line();
+void request_char();
+bool take_char(char *c);
+void request_held_key();
+bool take_held_key(char *c);
+void send_commands(const unsigned char *first, int first_size, const unsigned char *second, int second_size);
+void present_rows(const unsigned int *rgba, int first_row, int row_count);
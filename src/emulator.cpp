@@ -1,7 +1,9 @@
 #include "./emulator.h"
+#include "./modrm_table.h"
 #include <stdbool.h>
 #include <termios.h>
 #include <cstring>
+#include <algorithm>
 #include <ostream>
 #include <iostream>
 #include "unistd.h"
@@ -41,11 +43,50 @@ void PrintHeader(DOS_HEADER *header)
 }
 
 
-// calculate the start address 
-int DOSEmulator::CalculateStartAddress()
+// Gets the segment the program starts in relative to the image, the programs this runs keep it in the
+// first relocation rather than the header, without relocations the header's CS is used
+int DOSEmulator::GetEntrySegment()
 {
+    if (header->nreloc == 0)
+        return header->cs;
+
     RELOCATION *start_rel = (RELOCATION *)((char *)header + header->relocpos);
-    return (16 * header->hdrsize) + (start_rel->segment_value * 16);
+    return start_rel->segment_value;
+}
+
+// Copies the MZ image into guest memory at LOAD_SEGMENT and applies its relocations
+void DOSEmulator::LoadImage()
+{
+    int file_size = (header->lastsize ? (header->nblocks - 1) * 512 + header->lastsize : header->nblocks * 512);
+    int image_size = file_size - header->hdrsize * 16;
+
+    if (image_size < 0 || LOAD_SEGMENT * 16 + image_size > MEMORY_SIZE)
+    {
+        fprintf(stdout, "Program does not fit in memory\n");
+        exit(1);
+    }
+
+    AllocateMemory();
+    memcpy(memory + LOAD_SEGMENT * 16, data + header->hdrsize * 16, image_size);
+
+    // Every relocation points at a segment value in the image that is relative to where it gets loaded
+    for (int i = 0; i < header->nreloc; i++)
+    {
+        RELOCATION *rel = (RELOCATION *)((char *)header + header->relocpos + (i * 4));
+        unsigned char *fixup = memory + (LOAD_SEGMENT + (unsigned short)rel->segment_value) * 16 + (unsigned short)rel->offset;
+        unsigned short segment = (fixup[0] | (fixup[1] << 8)) + LOAD_SEGMENT;
+
+        fixup[0] = segment & 0xFF;
+        fixup[1] = segment >> 8;
+    }
+
+    // A far return to PSP:0000 ends the program through INT 20h like under DOS
+    memory[PSP_SEGMENT * 16] = 0xCD;
+    memory[PSP_SEGMENT * 16 + 1] = 0x20;
+
+    SetPageTypes(VGA_MEMORY_START, VGA_MEMORY_END, PAGE_VIDEO);
+    SetPageTypes(TEXT_MEMORY_START, TEXT_MEMORY_END, PAGE_VIDEO);
+    SetPageTypes(BIOS_ROM_START, MEMORY_SIZE, PAGE_ROM);
 }
 
 // prints information about the registers and flags
@@ -54,32 +95,32 @@ void DOSEmulator::PrintStack()
     fprintf(stdout, "Status:\n");
 
     fprintf(stdout, "\tRegisters:\n");
-    fprintf(stdout, "\t\tAX: %02x %02x", registers[AX][0], registers[AX][1]);
-    fprintf(stdout, "\t\tCX: %02x %02x", registers[CX][0], registers[CX][1]);
-    fprintf(stdout, "\t\tDX: %02x %02x", registers[DX][0], registers[DX][1]);
-    fprintf(stdout, "\t\tBX: %02x %02x\n", registers[BX][0], registers[BX][1]);
-    fprintf(stdout, "\t\tSP: %02x %02x", registers[SP][0], registers[SP][1]);
-    fprintf(stdout, "\t\tBP: %02x %02x", registers[BP][0], registers[BP][1]);
-    fprintf(stdout, "\t\tSI: %02x %02x", registers[SI][0], registers[SI][1]);
-    fprintf(stdout, "\t\tDI: %02x %02x\n", registers[DI][0], registers[DI][1]);
+    fprintf(stdout, "\t\tAX: %02x %02x", registers[AX].byte[HIGH_BYTE], registers[AX].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tCX: %02x %02x", registers[CX].byte[HIGH_BYTE], registers[CX].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tDX: %02x %02x", registers[DX].byte[HIGH_BYTE], registers[DX].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tBX: %02x %02x\n", registers[BX].byte[HIGH_BYTE], registers[BX].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tSP: %02x %02x", registers[SP].byte[HIGH_BYTE], registers[SP].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tBP: %02x %02x", registers[BP].byte[HIGH_BYTE], registers[BP].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tSI: %02x %02x", registers[SI].byte[HIGH_BYTE], registers[SI].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tDI: %02x %02x\n", registers[DI].byte[HIGH_BYTE], registers[DI].byte[LOW_BYTE]);
 
     fprintf(stdout, "\tSpecial Registers:\n");
-    fprintf(stdout, "\t\tES: %02x %02x", special_registers[ES][0], special_registers[ES][1]);
-    fprintf(stdout, "\t\tCS: %02x %02x", special_registers[CS][0], special_registers[CS][1]);
-    fprintf(stdout, "\t\tSS: %02x %02x\n", special_registers[SS][0], special_registers[SS][1]);
-    fprintf(stdout, "\t\tDS: %02x %02x", special_registers[DS][0], special_registers[DS][1]);
-    fprintf(stdout, "\t\tFS: %02x %02x", special_registers[FS][0], special_registers[FS][1]);
-    fprintf(stdout, "\t\tGS: %02x %02x\n", special_registers[GS][0], special_registers[GS][1]);
+    fprintf(stdout, "\t\tES: %02x %02x", special_registers[ES].byte[HIGH_BYTE], special_registers[ES].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tCS: %02x %02x", special_registers[CS].byte[HIGH_BYTE], special_registers[CS].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tSS: %02x %02x\n", special_registers[SS].byte[HIGH_BYTE], special_registers[SS].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tDS: %02x %02x", special_registers[DS].byte[HIGH_BYTE], special_registers[DS].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tFS: %02x %02x", special_registers[FS].byte[HIGH_BYTE], special_registers[FS].byte[LOW_BYTE]);
+    fprintf(stdout, "\t\tGS: %02x %02x\n", special_registers[GS].byte[HIGH_BYTE], special_registers[GS].byte[LOW_BYTE]);
 
     fprintf(stdout, "\tFlags:\n");
-    fprintf(stdout, "\t\tCF: %d", flags[CF] ? 1 : 0);
-    fprintf(stdout, "\t\tPF: %d", flags[PF] ? 1 : 0);
-    fprintf(stdout, "\t\tAF: %d", flags[AF] ? 1 : 0);
-    fprintf(stdout, "\t\tZF: %d\n", flags[ZF] ? 1 : 0);
-    fprintf(stdout, "\t\tSF: %d", flags[SF] ? 1 : 0);
-    fprintf(stdout, "\t\tIF: %d", flags[IF] ? 1 : 0);
-    fprintf(stdout, "\t\tDF: %d", flags[DF] ? 1 : 0);
-    fprintf(stdout, "\t\tOF: %d\n", flags[OF] ? 1 : 0);
+    fprintf(stdout, "\t\tCF: %d", GetFlag(CF) ? 1 : 0);
+    fprintf(stdout, "\t\tPF: %d", GetFlag(PF) ? 1 : 0);
+    fprintf(stdout, "\t\tAF: %d", GetFlag(AF) ? 1 : 0);
+    fprintf(stdout, "\t\tZF: %d\n", GetFlag(ZF) ? 1 : 0);
+    fprintf(stdout, "\t\tSF: %d", GetFlag(SF) ? 1 : 0);
+    fprintf(stdout, "\t\tIF: %d", GetFlag(IF) ? 1 : 0);
+    fprintf(stdout, "\t\tDF: %d", GetFlag(DF) ? 1 : 0);
+    fprintf(stdout, "\t\tOF: %d\n", GetFlag(OF) ? 1 : 0);
 }
 
 // clears the registers
@@ -87,14 +128,12 @@ void DOSEmulator::ClearRegisters()
 {
     for (int i = 0; i < 8; i++)
     {
-        registers[i][0] = 0;
-        registers[i][1] = 0;
+        registers[i].word = 0;
     }
 
     for (int i = 0; i < 6; i++)
     {
-        special_registers[i][0] = 0;
-        special_registers[i][1] = 0;
+        special_registers[i].word = 0;
     }
 }
 
@@ -105,6 +144,8 @@ void DOSEmulator::ClearFlags()
     {
         flags[i] = false;
     }
+
+    lazy_flags.pending = false;
 }
 
 
@@ -113,22 +154,41 @@ void DOSEmulator::SetRegistersFromHeader()
 {
     ClearRegisters();
 
-    short ss = header->ss;
-    short sp = header->sp;
-    short cs = header->cs;
+    // DS and ES point at the PSP when a DOS program starts
+    for (int i = 0; i < 6; i++)
+        SetSegment(i, PSP_SEGMENT);
 
-    special_registers[SS][0] = (ss >> 8) & 0xFF;
-    special_registers[SS][1] = ss & 0xFF;
+    SetSegment(SS, LOAD_SEGMENT + header->ss);
 
-    registers[SP][0] = (sp >> 8) & 0xFF;
-    registers[SP][1] = sp & 0xFF;
+    registers[SP].word = header->sp;
 
-    special_registers[CS][0] = (cs >> 8) & 0xFF;
-    special_registers[CS][1] = cs & 0xFF;
+    SetSegment(CS, LOAD_SEGMENT + GetEntrySegment());
 
     ip = header->ip;
 }
 
+// Writes a segment register and the linear base every access through it uses
+void DOSEmulator::SetSegment(unsigned char reg, unsigned short val)
+{
+    special_registers[reg].word = val;
+    segment_bases[reg] = memory + (val << 4);
+
+    if (reg != CS)
+        return;
+
+#ifdef JIT_SUPPORTED
+    // Compiled blocks have their instruction pointers relative to the old code segment built in
+    if (jit_enabled && jit_used > 0 && startAddress != (val << 4))
+    {
+        ResetJit();
+        tier_stats.flushes++;
+    }
+#endif
+
+    startAddress = val << 4;
+    opcodes = segment_bases[CS];
+}
+
 // Get a register from an opcode
 short DOSEmulator::GetRegister(char op)
 {
@@ -147,979 +207,124 @@ char DOSEmulator::GetModValue(char op)
     return ((op >> 6) & 0x3);
 }
 
-// Gets the start of the data segment 
-unsigned char *DOSEmulator::GetDataStart(short reg = DS)
+// Gets an 8 bit register from its encoding, 0 - 3 are the low halves of AX - BX and 4 - 7 the high halves
+unsigned char &DOSEmulator::ByteRegister(unsigned char reg)
 {
-    short ds_val = ((special_registers[reg][0] & 0xFF) << 8) + (special_registers[reg][1] & 0xFF);
-
-    return data + (header->hdrsize * 16) + (ds_val * 16);
+    return registers[reg & 0x3].byte[reg & 0x4 ? HIGH_BYTE : LOW_BYTE];
 }
 
-// Gets the Mod R/M value for 16 bit
-short DOSEmulator::GetModMemVal(char op, bool commit_changes)
+// Gets a register of the operand width from its encoding
+template <typename T>
+inline T *DOSEmulator::RegisterOperand(unsigned char reg)
 {
-    short val = 0;
-
-    int start_ip = ip;
-    switch (GetModValue(op))
-    {
-    case 0x0:
-    {
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[bx_val + si_val + 1] << 8) + GetDataStart()[bx_val + si_val];
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[bx_val + di_val + 1] << 8) + GetDataStart()[bx_val + di_val];
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[bp_val + si_val + 1] << 8) + GetDataStart()[bp_val + si_val];
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[bp_val + di_val + 1] << 8) + GetDataStart()[bp_val + di_val];
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[si_val + 1] << 8) + GetDataStart()[si_val];
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[di_val + 1] << 8) + GetDataStart()[di_val];
-            break;
-        }
-        case 0x6:
-        {
-            short offset = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-            val = (GetDataStart()[offset + 1] << 8) + GetDataStart()[offset];
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            val = (GetDataStart()[bx_val + 1] << 8) + GetDataStart()[bx_val];
-            break;
-        }
-
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x1:
-    {
-        short offset = opcodes[ip++];
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[offset + bx_val + si_val + 1] << 8) + GetDataStart()[offset + bx_val + si_val];
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[offset + bx_val + di_val + 1] << 8) + GetDataStart()[offset + bx_val + di_val];
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[offset + bp_val + si_val + 1] << 8) + GetDataStart()[offset + bp_val + si_val];
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[offset + bp_val + di_val + 1] << 8) + GetDataStart()[offset + bp_val + di_val];
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[offset + si_val + 1] << 8) + GetDataStart()[offset + si_val];
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[offset + di_val + 1] << 8) + GetDataStart()[offset + di_val];
-            break;
-        }
-        case 0x6:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            val = (GetDataStart()[offset + bp_val + 1] << 8) + GetDataStart()[offset + bp_val];
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            val = (GetDataStart()[offset + bx_val + 1] << 8) + GetDataStart()[offset + bx_val];
-            break;
-        }
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x2:
-    {
-        short offset = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[offset + bx_val + si_val + 1] << 8) + GetDataStart()[offset + bx_val + si_val];
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[offset + bx_val + di_val + 1] << 8) + GetDataStart()[offset + bx_val + di_val];
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[offset + bp_val + si_val + 1] << 8) + GetDataStart()[offset + bp_val + si_val];
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[offset + bp_val + di_val + 1] << 8) + GetDataStart()[offset + bp_val + di_val];
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = (GetDataStart()[offset + si_val + 1] << 8) + GetDataStart()[offset + si_val];
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = (GetDataStart()[offset + di_val + 1] << 8) + GetDataStart()[offset + di_val];
-            break;
-        }
-        case 0x6:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            val = (GetDataStart()[offset + bp_val + 1] << 8) + GetDataStart()[offset + bp_val];
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            val = (GetDataStart()[offset + bx_val + 1] << 8) + GetDataStart()[offset + bx_val];
-            break;
-        }
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x3:
-    {
-        val = registers[GetModRegister(op) % 4][1] + (registers[GetModRegister(op) % 4][0] << 8);
-        break;
-    }
-    default:
-        fprintf(stdout, "Error: %d\n", GetModValue(op));
-        break;
-    }
-    if (!commit_changes)
-        ip = start_ip;
-
-    return val;
+    if (sizeof(T) == 1)
+        return (T *)&ByteRegister(reg);
+    return (T *)&registers[reg].word;
 }
 
-// Sets the Mod R/M value for 16 bit
-void DOSEmulator::SetModMemVal(short val, char op, bool commit_changes)
+// Gets the start of a segment in guest memory, DS if none is given
+inline unsigned char *DOSEmulator::GetDataStart(short reg = DS)
 {
-
-    int start_ip = ip;
-    switch (GetModValue(op))
-    {
-    case 0x0:
-    {
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[bx_val + si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[bx_val + si_val] = val & 0xFF;
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[bx_val + di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[bx_val + di_val] = val & 0xFF;
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[bp_val + si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[bp_val + si_val] = val & 0xFF;
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[bp_val + di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[bp_val + di_val] = val & 0xFF;
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[si_val] = val & 0xFF;
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[di_val] = val & 0xFF;
-            break;
-        }
-        case 0x6:
-        {
-            short offset = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset] = val & 0xFF;
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[bx_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[bx_val] = val & 0xFF;
-            break;
-        }
-
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x1:
-    {
-        short offset = opcodes[ip++];
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bx_val + si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bx_val + si_val] = val & 0xFF;
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bx_val + di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bx_val + di_val] = val & 0xFF;
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bp_val + si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bp_val + si_val] = val & 0xFF;
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bp_val + di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bp_val + di_val] = val & 0xFF;
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + si_val] = val & 0xFF;
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + di_val] = val & 0xFF;
-            break;
-        }
-        case 0x6:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bp_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bp_val] = val & 0xFF;
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bx_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bx_val] = val & 0xFF;
-            break;
-        }
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x2:
-    {
-        short offset = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bx_val + si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bx_val + si_val] = val & 0xFF;
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bx_val + di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bx_val + di_val] = val & 0xFF;
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bp_val + si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bp_val + si_val] = val & 0xFF;
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bp_val + di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bp_val + di_val] = val & 0xFF;
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + si_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + si_val] = val & 0xFF;
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + di_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + di_val] = val & 0xFF;
-            break;
-        }
-        case 0x6:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bp_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bp_val] = val & 0xFF;
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            if (val == NULL)
-                val = (opcodes[ip++] << 8) + opcodes[ip++];
-            GetDataStart()[offset + bx_val + 1] = (val >> 8) & 0xFF;
-            GetDataStart()[offset + bx_val] = val & 0xFF;
-            break;
-        }
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x3:
-    {
-        registers[GetModRegister(op) % 4][0] = (val >> 8) & 0xFF;
-        registers[GetModRegister(op) % 4][1] = val & 0xFF;
-        break;
-    }
-    default:
-        fprintf(stdout, "Error: %d\n", GetModValue(op));
-        break;
-    }
-    if (!commit_changes)
-        ip = start_ip;
+    return segment_bases[reg];
 }
 
-// Gets the Mod R/M value for 8 bit
-char DOSEmulator::GetModMemVal8(char op, bool commit_changes)
+// Gets the offset of a memory operand within its segment
+inline unsigned short DOSEmulator::GetEffectiveAddress(DECODED_INSTR *instr)
 {
-    char val = 0;
-
-    int start_ip = ip;
-    switch (GetModValue(op))
-    {
-    case 0x0:
-    {
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[bx_val + si_val];
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[bx_val + di_val];
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[bp_val + si_val];
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[bp_val + di_val];
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[si_val];
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[di_val];
-            break;
-        }
-        case 0x6:
-        {
-            short offset = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-            val = GetDataStart()[offset];
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            val = GetDataStart()[bx_val];
-            break;
-        }
-
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x1:
-    {
-        short offset = opcodes[ip++];
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[offset + bx_val + si_val];
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[offset + bx_val + di_val];
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[offset + bp_val + si_val];
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[offset + bp_val + di_val];
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[offset + si_val];
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[offset + di_val];
-            break;
-        }
-        case 0x6:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            val = GetDataStart()[offset + bp_val];
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            val = GetDataStart()[offset + bx_val];
-            break;
-        }
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x2:
-    {
-        short offset = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[offset + bx_val + si_val];
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[offset + bx_val + di_val];
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[offset + bp_val + si_val];
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[offset + bp_val + di_val];
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            val = GetDataStart()[offset + si_val];
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            val = GetDataStart()[offset + di_val];
-            break;
-        }
-        case 0x6:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            val = GetDataStart()[offset + bp_val];
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            val = GetDataStart()[offset + bx_val];
-            break;
-        }
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x3:
-    {
-        val = registers[GetModRegister(op) % 4][GetModRegister(op) <= 3];
-        break;
-    }
-    default:
-        fprintf(stdout, "Error: %d\n", GetModValue(op));
-        break;
-    }
+    const MODRM_ENTRY &entry = modrm_table.entries[instr->modrm];
+    unsigned short offset = instr->disp;
 
+    if (entry.base != NO_REGISTER)
+        offset += registers[entry.base].word;
+    if (entry.index != NO_REGISTER)
+        offset += registers[entry.index].word;
 
-    if (!commit_changes)
-        ip = start_ip;
-
-        
-
-    return val;
+    return offset;
 }
-
-// Sets the Mod R/M value for 8 bit
-void DOSEmulator::SetModMemVal8(char val, char op, bool commit_changes)
-{
-    int start_ip = ip;
-    switch (GetModValue(op))
-    {
-    case 0x0:
-    {
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[bx_val + si_val] = val;
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[bx_val + di_val] = val;
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[bp_val + si_val] = val;
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[bp_val + di_val] = val;
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[si_val] = val;
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[di_val] = val;
-            break;
-        }
-        case 0x6:
-        {
-            short offset = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-            if (val == NULL)
-                val = opcodes[ip++];
-
-            GetDataStart()[offset] = val;
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[bx_val] = val;
-            break;
-        }
-
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x1:
-    {
-        short offset = opcodes[ip++];
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bx_val + si_val] = val;
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bx_val + di_val] = val;
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bp_val + si_val] = val;
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bp_val + di_val] = val;
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + si_val] = val;
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + di_val] = val;
-            break;
-        }
-        case 0x6:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bp_val] = val;
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bx_val] = val;
-            break;
-        }
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x2:
-    {
-        short offset = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-        switch (GetModRegister(op))
-        {
-        case 0x0:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bx_val + si_val] = val;
-            break;
-        }
-        case 0x1:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bx_val + di_val] = val;
-            break;
-        }
-        case 0x2:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bp_val + si_val] = val;
-            break;
-        }
-        case 0x3:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bp_val + di_val] = val;
-            break;
-        }
-        case 0x4:
-        {
-            short si_val = ((registers[SI][0] << 8) & 0xFF) + (registers[SI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + si_val] = val;
-            break;
-        }
-        case 0x5:
-        {
-            short di_val = ((registers[DI][0] << 8) & 0xFF) + (registers[DI][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + di_val] = val;
-            break;
-        }
-        case 0x6:
-        {
-            short bp_val = ((registers[BP][0] << 8) & 0xFF) + (registers[BP][1] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bp_val] = val;
-            break;
-        }
-        case 0x7:
-        {
-            short bx_val = ((registers[BX][BH] << 8) & 0xFF) + (registers[BX][BL] & 0xFF);
-            if (val == NULL)
-                val = opcodes[ip++];
-            GetDataStart()[offset + bx_val] = val;
-            break;
-        }
-        default:
-            fprintf(stdout, "Error: %d\n", GetModRegister(op));
-            break;
-        }
-        break;
-    }
-    case 0x3:
+
+// Resolves the Mod R/M operand to where it is stored, a register or guest memory.
+// Resolve once and use the pointer for both the read and the write of an instruction,
+// Write sends the store through StoreAddress so special pages see it
+template <typename T, bool Write>
+inline T *DOSEmulator::ResolveOperand(DECODED_INSTR *instr)
+{
+    const MODRM_ENTRY &entry = modrm_table.entries[instr->modrm];
+
+    if (entry.is_register)
+        return RegisterOperand<T>(entry.base);
+
+    unsigned char *address = GetDataStart(entry.segment) + GetEffectiveAddress(instr);
+
+    if (Write)
+        return (T *)StoreAddress(address, sizeof(T));
+
+    return (T *)address;
+}
+
+// Gets where a store of size bytes to guest memory goes. Plain RAM is written in place,
+// any other page type takes the slow path
+inline unsigned char *DOSEmulator::StoreAddress(unsigned char *address, int size)
+{
+    int linear = address - memory;
+    unsigned char type = page_types[(linear >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGE_COUNT - 1)] |
+                         page_types[((linear + size - 1) >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGE_COUNT - 1)];
+
+    if (type == PAGE_RAM)
+        return address;
+
+    return SpecialStore(address, size);
+}
+
+// Handles a store to pages that aren't plain RAM. Returns where the bytes should be written,
+// a scratch copy for ROM so the store is lost
+unsigned char *DOSEmulator::SpecialStore(unsigned char *address, int size)
+{
+    int linear = address - memory;
+    unsigned char type = page_types[(linear >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGE_COUNT - 1)] |
+                         page_types[((linear + size - 1) >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGE_COUNT - 1)];
+
+    if (type & PAGE_CODE)
+        MarkWritten(linear, size);
+
+    if (type & PAGE_VIDEO)
+        MarkScanlines(linear, size);
+
+    if ((type & PAGE_WATCH) && CheckIfWatched(linear, size))
+        debug = true;
+
+    if (type & PAGE_ROM)
     {
-        registers[GetModRegister(op) % 4][GetModRegister(op) <= 3] = val;
-        break;
-    }
-    default:
-        fprintf(stdout, "Error: %d\n", GetModValue(op));
-        break;
+        memcpy(rom_sink, address, size);
+        return rom_sink;
     }
-    if (!commit_changes)
-        ip = start_ip;
+
+    return address;
+}
+
+// Adds a type to the pages of guest memory from start up to end
+void DOSEmulator::SetPageTypes(int start, int end, unsigned char type)
+{
+    for (int page = start >> MEMORY_PAGE_SHIFT; page < end >> MEMORY_PAGE_SHIFT; page++)
+        page_types[page] |= type;
+}
+
+// Bumps the write generation of the pages a store touches when it overwrites bytes an instruction was
+// decoded from, code cached from them is decoded again when next fetched. The page 15 bytes back is
+// bumped too since an instruction starting there can reach into the written bytes. Stores to data next
+// to code leave the cached code alone
+inline void DOSEmulator::MarkWritten(int address, int size)
+{
+    // Addresses wrap around at 1 MiB like the pages, the mirror of the first 64K is the same code
+    int i = address;
+
+    while (i < address + size && !(decoded_map[(i & (MEMORY_SIZE - 1)) >> 3] & (1 << (i & 0x7))))
+        i++;
+
+    if (i == address + size)
+        return;
+
+    for (int page = (address - 15) >> CODE_PAGE_SHIFT; page <= (address + size - 1) >> CODE_PAGE_SHIFT; page++)
+        page_generation[page & (CODE_PAGE_COUNT - 1)]++;
 }
 
 // Performs DOS interrupts
@@ -1129,122 +334,189 @@ void DOSEmulator::PerformInterrupt(char val)
     {
     case 0x10:
     {
-        switch (registers[AX][AH])
+        switch (registers[AX].byte[AH])
         {
         case 0x0:
         {
-            if (registers[AX][AL] == 0x13)
+            if (registers[AX].byte[AL] == 0x13)
             {
-                send_ping_async("activate_video_mode");
+                HostCommand(HOST_VIDEO_MODE, NULL, 0);
                 video_mode = true;
+                SetDefaultPalette();
+
+                // Setting the mode clears the screen and homes the cursor
+                memset(StoreRange(memory + VGA_MEMORY_START, VGA_WIDTH * VGA_HEIGHT), 0, VGA_WIDTH * VGA_HEIGHT);
+
+                vCursor->row = 0;
+                vCursor->column = 0;
+            }
+            else if (registers[AX].byte[AL] <= 0x3)
+            {
+                // The 80x25 text modes, 40 column modes are shown as 80 columns
+                video_mode = false;
+                SetDefaultPalette();
+                ClearText();
             }
             break;
         }
         case 0x2:
         {
-            vCursor->row = registers[DX][DH];
-            vCursor->column = registers[DX][DL];
-            vCursor->page_number = registers[BX][BH];
+            vCursor->row = registers[DX].byte[DH];
+            vCursor->column = registers[DX].byte[DL];
+            vCursor->page_number = registers[BX].byte[BH];
 
             break;
         }
         // This could potentially be slightly wrong
         case 0xb:
         {
-            emscripten_sleep(20);
-            send_ping_and_char_async("set_background_color", registers[BX][BL]);
+            // In text modes it sets the border, which isn't shown. The host clears the whole canvas,
+            // so every scanline is sent again over it
+            if (video_mode)
+            {
+                HostCommand(HOST_BACKGROUND, &registers[BX].byte[BL], 1);
+                video_dirty = true;
+                memset(dirty_lines, 0xff, sizeof(dirty_lines));
+            }
             break;
         }
+        // Pixels are written to the framebuffer like any other store, the host sees them with the next frame
         case 0xc:
         {
-            std::string send("draw_pixel::");
+            unsigned short x = registers[CX].word;
+            unsigned short y = registers[DX].word;
+
+            if (x < VGA_WIDTH && y < VGA_HEIGHT)
+                *StoreAddress(memory + VGA_MEMORY_START + y * VGA_WIDTH + x, 1) = registers[AX].byte[AL];
+            break;
+        }
+        case 0xd:
+        {
+            unsigned short x = registers[CX].word;
+            unsigned short y = registers[DX].word;
+
+            registers[AX].byte[AL] = (x < VGA_WIDTH && y < VGA_HEIGHT) ? memory[VGA_MEMORY_START + y * VGA_WIDTH + x] : 0;
+            break;
+        }
+        // Writes a character at the cursor, in mode 13h BL is its color
+        case 0xe:
+        {
+            TeletypeCharacter(registers[AX].byte[AL], video_mode ? registers[BX].byte[BL] : -1);
+            break;
+        }
+        case 0x10:
+        {
+            // Sets one DAC register, or a block of them from a table of red, green and blue at ES:DX
+            if (registers[AX].byte[AL] == 0x10)
+            {
+                SetDacColor(registers[BX].word, registers[DX].byte[DH], registers[CX].byte[CH], registers[CX].byte[CL]);
+            }
+            else if (registers[AX].byte[AL] == 0x12)
+            {
+                unsigned char *table = GetDataStart(ES) + registers[DX].word;
+
+                for (int i = 0; i < registers[CX].word && registers[BX].word + i < 256; i++)
+                    SetDacColor(registers[BX].word + i, table[i * 3], table[i * 3 + 1], table[i * 3 + 2]);
+            }
+            else
+            {
+                fprintf(stdout, "Not yet Implemented: 10%02x\n", registers[AX].byte[AL]);
+            }
+            break;
+        }
+        case 0x13:
+        {
+            // Writes CX characters from ES:BP starting at row DH, column DL. With bit 1 of AL set an attribute
+            // follows each character, otherwise they all get BL. With bit 0 clear the cursor stays where it was
+            unsigned char *text = GetDataStart(ES) + registers[BP].word;
+            bool attributes = registers[AX].byte[AL] & 0x2;
+            Cursor saved = *vCursor;
 
-            send.append(std::to_string(registers[AX][AL]));
-            send.append("::");
-            send.append(std::to_string((registers[CX][CH] << 8) + registers[CX][CL]));
-            send.append("::");
-            send.append(std::to_string((registers[DX][DH] << 8) + registers[DX][DL]));
+            vCursor->row = registers[DX].byte[DH];
+            vCursor->column = registers[DX].byte[DL];
+
+            for (int i = 0; i < registers[CX].word; i++)
+            {
+                if (attributes)
+                    TeletypeCharacter(text[i * 2], text[i * 2 + 1]);
+                else
+                    TeletypeCharacter(text[i], registers[BX].byte[BL]);
+            }
 
-            send_ping_async((char *)send.c_str());
+            if (!(registers[AX].byte[AL] & 0x1))
+                *vCursor = saved;
             break;
         }
         default:
-            fprintf(stdout, "Not yet Implemented: %02x\n", registers[AX][AH]);
+            fprintf(stdout, "Not yet Implemented: %02x\n", registers[AX].byte[AH]);
             break;
         }
         break;
     }
     case 0x16:
     {
-        switch (registers[AX][AH])
+        switch (registers[AX].byte[AH])
         {
         case 0x0:
         {
             // AH needs to be set to BIOS scan code
-            registers[AX][AL] = get_char_async();
+            ReadKey(&registers[AX].byte[AL]);
             break;
         }
         case 0x1:
         {
-            char val = get_char_async(true);
-
-            if (val == '\x00')
+            // Reports the key the host says is held down, without waiting for one
+            if (held_key == '\x00')
             {
-            flags[ZF] = 1;
+                SetFlag(ZF, true);
             }
             else
             {
-                registers[AX][AL] = val;
-                flags[ZF] = 0;
+                registers[AX].byte[AL] = held_key;
+                SetFlag(ZF, false);
             }
 
             break;
         }
         default:
-            fprintf(stdout, "Not yet Implemented: %02x\n", registers[AX][AH]);
+            fprintf(stdout, "Not yet Implemented: %02x\n", registers[AX].byte[AH]);
             break;
         }
         break;
     }
     case 0x21:
     {
-        switch (registers[AX][AH])
+        switch (registers[AX].byte[AH])
         {
         case WRITE_CHAR_STDOUT:
         {
-            send_ping_and_char_async("write", registers[DX][DL]);
-            registers[AX][AL] = registers[DX][DL];
+            // Like AH=09h, in mode 13h the character is only drawn into the framebuffer
+            WriteTeletype(&registers[DX].byte[DL], 1);
+
+            if (!video_mode)
+                HostWrite(&registers[DX].byte[DL], 1);
+
+            registers[AX].byte[AL] = registers[DX].byte[DL];
             break;
         }
         case READ_CHAR_STDIN_NOECHO:
         {
-            registers[AX][AL] = get_char_async();
+            ReadKey(&registers[AX].byte[AL]);
             break;
         }
         case WRITE_STR_STDOUT:
         {
-            if (video_mode)
-            {
-                std::string send("write::");
-                short dx_val = ((registers[DX][DH] << 8) & 0xFF) + (registers[DX][DL] & 0xFF);
-                while (GetDataStart()[dx_val] != '$')
-                    send.append(1, GetDataStart()[dx_val++]);
+            unsigned char *text = GetDataStart() + registers[DX].word;
+            unsigned char *end = (unsigned char *)memchr(text, '$', MEMORY_SIZE + MEMORY_SLACK - (text - memory));
+            int len = end ? end - text : 0;
 
-                send.append("::");
-                send.append(std::to_string(vCursor->column));
-                send.append("::");
-                send.append(std::to_string(vCursor->row));
+            // In mode 13h the text is only drawn into the framebuffer, the host sees it with the next frame
+            WriteTeletype(text, len);
 
-                send_ping_async((char *)send.c_str());
-            }
-            else
-            {
-                short dx_val = ((registers[DX][DH] << 8) & 0xFF) + (registers[DX][DL] & 0xFF);
-                while (GetDataStart()[dx_val] != '$')
-                    send_ping_and_char_async("write", GetDataStart()[dx_val++]);
+            if (!video_mode)
+                HostWrite(text, len);
 
-                registers[AX][AL] = 0x24;
-            }
+            registers[AX].byte[AL] = 0x24;
             break;
         }
         case GET_SYSTEM_TIME:
@@ -1253,21 +525,24 @@ void DOSEmulator::PerformInterrupt(char val)
             gettimeofday(&time_now, NULL);
             struct tm *time_str_tm = gmtime(&time_now.tv_sec);
 
-            registers[CX][CH] = (time_str_tm->tm_hour) & 0xFF;
-            registers[CX][CL] = (time_str_tm->tm_min) & 0xFF;
-            registers[DX][DH] = (time_str_tm->tm_sec) & 0xFF;
-            registers[DX][DL] = (time_now.tv_usec / 100) & 0xFF;
+            registers[CX].byte[CH] = (time_str_tm->tm_hour) & 0xFF;
+            registers[CX].byte[CL] = (time_str_tm->tm_min) & 0xFF;
+            registers[DX].byte[DH] = (time_str_tm->tm_sec) & 0xFF;
+            registers[DX].byte[DL] = (time_now.tv_usec / 100) & 0xFF;
 
             break;
         }
         case EXIT_PROGRAM:
         {
-            fprintf(stdout, "\nExit with code: %d\n", registers[AX][AL]);
+            // The program's own output goes before the exit message
+            FlushCommands();
+            fprintf(stdout, "\nExit with code: %d\n", registers[AX].byte[AL]);
             run = false;
+            StopRun(STOP_EXIT);
             break;
         }
         default:
-            fprintf(stdout, "Not yet Implemented: %d\n", registers[AX][AH]);
+            fprintf(stdout, "Not yet Implemented: %d\n", registers[AX].byte[AH]);
             break;
         }
         break;
@@ -1277,340 +552,633 @@ void DOSEmulator::PerformInterrupt(char val)
     }
 }
 
-// Checks if the carry flag should be set
-bool DOSEmulator::CheckIfCarry(unsigned short val1, unsigned short val2, char operation)
+// Takes the oldest key the host pushed. Without one the INT is backed up to run again once
+// there is a key and RunFor returns STOP_INPUT
+bool DOSEmulator::ReadKey(unsigned char *key)
 {
-    bool val = false;
-    switch (operation)
-    {
-    case SUBTRACTION:
+    if (key_head == key_tail)
     {
-        // If the first bit is 0 and then becomes 1 we had to carry
-        if (!(val2 & 0x8) && ((val2 - val1) & 0x8) == 8)
-            val = true;
-        break;
+        ip -= 2;
+        StopRun(STOP_INPUT);
+        return false;
     }
-    case ADDITION:
+
+    *key = key_queue[key_tail++ & (KEY_QUEUE_SIZE - 1)];
+    return true;
+}
+
+// Queues a key for the program to read, keys past a full queue are dropped
+void DOSEmulator::PushKey(char key)
+{
+    if (key_head - key_tail < KEY_QUEUE_SIZE)
+        key_queue[key_head++ & (KEY_QUEUE_SIZE - 1)] = key;
+}
+
+// Sets the key INT 16h AH=01h reports as held down, 0 for none
+void DOSEmulator::SetHeldKey(char key)
+{
+    held_key = key;
+}
+
+// Gets how many guest instructions ran since the program started
+long long DOSEmulator::GetInstructionsExecuted()
+{
+    return instr_executed;
+}
+
+// Makes room for size bytes of commands, handing what's queued to the host if they don't fit
+inline void DOSEmulator::ReserveCommands(int size)
+{
+    if (COMMAND_RING_SIZE - (command_head - command_tail) < (unsigned int)size)
+        FlushCommands();
+}
+
+// Queues a command for the host, its payload can be in two parts
+void DOSEmulator::HostCommand(unsigned char command, const unsigned char *payload, int size,
+                              const unsigned char *extra, int extra_size)
+{
+    ReserveCommands(1 + size + extra_size);
+
+    command_ring[command_head++ & (COMMAND_RING_SIZE - 1)] = command;
+
+    for (int i = 0; i < size; i++)
+        command_ring[command_head++ & (COMMAND_RING_SIZE - 1)] = payload[i];
+
+    for (int i = 0; i < extra_size; i++)
+        command_ring[command_head++ & (COMMAND_RING_SIZE - 1)] = extra[i];
+
+    write_open = false;
+}
+
+// Queues program output. Text written right after more text extends the same HOST_WRITE,
+// so a string printed a character at a time still reaches the host as one command
+void DOSEmulator::HostWrite(const unsigned char *text, int len)
+{
+    while (len > 0)
     {
-        // If the first bit is 1 and then becomes 0 we had to carry
-        if ((val2 & 0x8) == 8 && !((val2 + val1) & 0x8))
-            val = true;
-        break;
-    }
-    default:
-        fprintf(stdout, "Check carry not implemented\n");
-        break;
+        if (!write_open || write_len == 0xFFFF)
+        {
+            ReserveCommands(4);
+
+            command_ring[command_head++ & (COMMAND_RING_SIZE - 1)] = HOST_WRITE;
+            write_start = command_head;
+            command_head += 2;
+            write_len = 0;
+            write_open = true;
+        }
+
+        unsigned int room = COMMAND_RING_SIZE - (command_head - command_tail);
+
+        // The ring is full, send what's queued and start a new command after it
+        if (room == 0)
+        {
+            FlushCommands();
+            continue;
+        }
+
+        int count = std::min(std::min(len, (int)room), 0xFFFF - write_len);
+
+        for (int i = 0; i < count; i++)
+            command_ring[command_head++ & (COMMAND_RING_SIZE - 1)] = text[i];
+
+        text += count;
+        len -= count;
+        write_len += count;
+
+        command_ring[write_start & (COMMAND_RING_SIZE - 1)] = write_len & 0xFF;
+        command_ring[(write_start + 1) & (COMMAND_RING_SIZE - 1)] = write_len >> 8;
     }
-    return val;
 }
 
-// Checks if the parity flag should be set
-bool DOSEmulator::CheckIfParity(unsigned short val1, unsigned short val2, char operation)
+// Hands the queued commands to the host. They can wrap around the end of the ring, then
+// the host gets them as two parts
+void DOSEmulator::FlushCommands()
+{
+    unsigned int queued = command_head - command_tail;
+
+    if (queued == 0)
+        return;
+
+    unsigned int start = command_tail & (COMMAND_RING_SIZE - 1);
+    unsigned int first = std::min(queued, COMMAND_RING_SIZE - start);
+
+    send_commands(command_ring + start, first, command_ring, queued - first);
+
+    command_tail = command_head;
+    write_open = false;
+}
+
+// Ends the current RunFor after the instruction that is running
+void DOSEmulator::StopRun(int reason)
+{
+    stop_reason = reason;
+    stop_at = instr_executed;
+}
+
+// Records the operands and result of an arithmetic instruction, the flags are only computed when read
+template <typename T>
+inline void DOSEmulator::UpdateFlags(T val1, T val2, unsigned int result, char operation)
 {
-    bool val = false;
-    switch (operation)
+    lazy_flags.val1 = val1;
+    lazy_flags.val2 = val2;
+    lazy_flags.result = result;
+    lazy_flags.operation = operation;
+    lazy_flags.width = sizeof(T);
+    lazy_flags.pending = true;
+}
+
+// Performs an ALU operation, records its flags and returns the result truncated to the operand width
+template <typename T, int Operation>
+inline T DOSEmulator::Alu(T val1, T val2)
+{
+    unsigned int result;
+
+    switch (Operation)
     {
+    case ADD:
+        result = val1 + val2;
+        UpdateFlags<T>(val1, val2, result, ADDITION);
+        break;
+    case ADC:
+        result = val1 + val2 + GetFlag(CF);
+        UpdateFlags<T>(val1, val2, result, ADDITION);
+        break;
+    case SUB:
+    case CMP:
+        result = val1 - val2;
+        UpdateFlags<T>(val1, val2, result, SUBTRACTION);
+        break;
+    case SBB:
+        result = val1 - val2 - GetFlag(CF);
+        UpdateFlags<T>(val1, val2, result, SUBTRACTION);
+        break;
+    case OR:
+        result = val1 | val2;
+        UpdateFlags<T>(val1, val2, result, LOGIC);
+        break;
+    case AND:
+    case TEST:
+        result = val1 & val2;
+        UpdateFlags<T>(val1, val2, result, LOGIC);
+        break;
     default:
-        fprintf(stdout, "Check parity not implemented\n");
+        result = val1 ^ val2;
+        UpdateFlags<T>(val1, val2, result, LOGIC);
         break;
     }
-    return val;
+
+    return result;
 }
 
-// Checks if the auxiliary flag should be set
-bool DOSEmulator::CheckIfAuxiliary(unsigned short val1, unsigned short val2, char operation)
+// Performs INC or DEC and records its flags. They are recorded like adding or subtracting 1,
+// but CF isn't touched, so the carry the previous instruction left is saved in flags first
+template <typename T, int Operation>
+inline T DOSEmulator::IncDec(T val)
+{
+    unsigned int result = Operation == INC ? val + 1 : val - 1;
+
+    flags[CF] = GetFlag(CF);
+    UpdateFlags<T>(val, 1, result, Operation == INC ? INCREMENT : DECREMENT);
+
+    return result;
+}
+
+// Runs an ALU opcode with a Mod R/M operand, ToRegister makes the reg field the destination
+template <typename T, int Operation, bool ToRegister>
+inline void DOSEmulator::AluModRM(DECODED_INSTR *instr)
+{
+    T *operand = ResolveOperand<T, !ToRegister && Operation != CMP && Operation != TEST>(instr);
+    T *reg = RegisterOperand<T>(instr->reg);
+    T *dest = ToRegister ? reg : operand;
+
+    T result = Alu<T, Operation>(*dest, ToRegister ? *operand : *reg);
+
+    if (Operation != CMP && Operation != TEST)
+        *dest = result;
+}
+
+// Runs an ALU opcode on AL or AX and an immediate
+template <typename T, int Operation>
+inline void DOSEmulator::AluAccumulator(DECODED_INSTR *instr)
+{
+    T *acc = RegisterOperand<T>(AX);
+
+    T result = Alu<T, Operation>(*acc, instr->imm);
+
+    if (Operation != CMP && Operation != TEST)
+        *acc = result;
+}
+
+// Runs the immediate group opcodes 0x80 - 0x83, the reg field picks the operation
+template <typename T>
+inline void DOSEmulator::AluGroup(DECODED_INSTR *instr)
 {
-    bool val = false;
-    switch (operation)
+    T *operand = instr->reg == CMP ? ResolveOperand<T>(instr) : ResolveOperand<T, true>(instr);
+    T val = instr->imm;
+
+    switch (instr->reg)
     {
+    case ADD:
+        *operand = Alu<T, ADD>(*operand, val);
+        break;
+    case OR:
+        *operand = Alu<T, OR>(*operand, val);
+        break;
+    case ADC:
+        *operand = Alu<T, ADC>(*operand, val);
+        break;
+    case SBB:
+        *operand = Alu<T, SBB>(*operand, val);
+        break;
+    case AND:
+        *operand = Alu<T, AND>(*operand, val);
+        break;
+    case SUB:
+        *operand = Alu<T, SUB>(*operand, val);
+        break;
+    case XOR:
+        *operand = Alu<T, XOR>(*operand, val);
+        break;
     default:
-        fprintf(stdout, "Check auxiliary not implemented\n");
+        Alu<T, CMP>(*operand, val);
         break;
     }
-    return val;
 }
 
-// Checks if the zero flag should be set
-bool DOSEmulator::CheckIfZero(unsigned short val1, unsigned short val2, char operation)
+// Elements of size bytes a string instruction can step through from offset before it wraps around the segment
+static inline int ElementsBeforeWrap(unsigned short offset, int size, bool down)
 {
-    bool val = false;
-    switch (operation)
-    {
-    case SUBTRACTION:
+    return down ? offset / size + 1 : (0x10000 - offset) / size;
+}
+
+// Finds the first of count elements where a and b are equal (equal) or differ, count if there is none.
+// The steps are in bytes, a step of 0 compares every element against the same value
+template <typename T>
+static int FindElement(const unsigned char *a, int a_step, const unsigned char *b, int b_step, int count, bool equal)
+{
+    int i = 0;
+
+    // Forward byte compares for a mismatch go 8 bytes at a time
+    if (!equal && sizeof(T) == 1 && a_step == 1 && b_step == 1)
     {
-        if (!(val2 - val1))
-            val = true;
-        break;
+        for (; i + 8 <= count; i += 8)
+        {
+            unsigned long long x, y;
+
+            memcpy(&x, a + i, 8);
+            memcpy(&y, b + i, 8);
+
+            if (x != y)
+                break;
+        }
     }
-    case ADDITION:
+
+    for (; i < count; i++)
     {
-        if (!(val2 + val1))
-            val = true;
-        break;
+        T x, y;
+
+        memcpy(&x, a + i * a_step, sizeof(T));
+        memcpy(&y, b + i * b_step, sizeof(T));
+
+        if ((x == y) == equal)
+            break;
     }
-    case XOR:
+
+    return i;
+}
+
+// Runs one element of a string instruction, SI and DI move by the element size in the direction DF gives
+template <typename T>
+void DOSEmulator::StringStep(unsigned char op)
+{
+    unsigned short delta = GetFlag(DF) ? -sizeof(T) : sizeof(T);
+    T *source = (T *)(GetDataStart(DS) + registers[SI].word);
+    T *destination = (T *)(GetDataStart(ES) + registers[DI].word);
+    T *accumulator = RegisterOperand<T>(AX);
+
+    switch (op & 0xFE)
     {
-        if (!(val2 ^ val1))
-            val = true;
+    case MOVSB:
+        *(T *)StoreAddress((unsigned char *)destination, sizeof(T)) = *source;
+        break;
+    case CMPSB:
+        Alu<T, CMP>(*source, *destination);
+        break;
+    case STOSB:
+        *(T *)StoreAddress((unsigned char *)destination, sizeof(T)) = *accumulator;
+        break;
+    case LODSB:
+        *accumulator = *source;
         break;
-    }
     default:
-        fprintf(stdout, "Check zero not implemented\n");
+        Alu<T, CMP>(*accumulator, *destination);
         break;
     }
-    return val;
+
+    if ((op & 0xFE) != STOSB && (op & 0xFE) != SCASB)
+        registers[SI].word += delta;
+    if ((op & 0xFE) != LODSB)
+        registers[DI].word += delta;
 }
 
-// Checks if the sign flag should be set
-bool DOSEmulator::CheckIfSign(unsigned short val1, unsigned short val2, char operation)
+// Runs count elements of a repeated string instruction with host memory functions. None of them
+// may wrap around a segment. Returns how many ran, compares stop after the element that ends the
+// repeat and leave the flags of that element. 0 means the interpreter has to step instead
+template <typename T>
+int DOSEmulator::StringBulk(unsigned char op, unsigned char prefix, int count, bool down)
 {
-    bool val = false;
-    switch (operation)
+    int size = sizeof(T);
+    int step = down ? -size : size;
+    int bytes = count * size;
+    unsigned char *source = GetDataStart(DS) + registers[SI].word;
+    unsigned char *destination = GetDataStart(ES) + registers[DI].word;
+    unsigned char *source_low = down ? source - bytes + size : source;
+    unsigned char *destination_low = down ? destination - bytes + size : destination;
+    T *accumulator = RegisterOperand<T>(AX);
+    int done = count;
+
+    switch (op & 0xFE)
     {
-    case SUBTRACTION:
+    case MOVSB:
     {
-        if ((short)(val1 - val2) < 0)
-            val = true;
+        if (StoreRange(destination_low, bytes) == NULL)
+            return 0;
+
+        // A copy into its own source repeats the pattern on an 8086, so it has to go element by element
+        bool overlapping = down ? (destination < source && destination > source - bytes)
+                                : (destination > source && destination < source + bytes);
+
+        if (!overlapping)
+        {
+            memmove(destination_low, source_low, bytes);
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+            memcpy(destination + i * step, source + i * step, size);
         break;
     }
-    case ADDITION:
+    case STOSB:
     {
-        if ((short)(val1 + val2) < 0)
-            val = true;
+        if (StoreRange(destination_low, bytes) == NULL)
+            return 0;
+
+        T val = *accumulator;
+
+        if (sizeof(T) == 1 || (val & 0xFF) == (val >> 8))
+        {
+            memset(destination_low, val & 0xFF, bytes);
+            break;
+        }
+
+        for (int i = 0; i < bytes; i += size)
+            memcpy(destination_low + i, &val, size);
         break;
     }
-    case XOR:
+    case LODSB:
+        // Only the last element loaded stays in the accumulator
+        memcpy(accumulator, source + (count - 1) * step, size);
+        break;
+    case CMPSB:
     {
-        if ((short)(val1 ^ val2) < 0)
-            val = true;
+        done = FindElement<T>(source, step, destination, step, count, prefix == REPNE);
+        int last = done < count ? done++ : count - 1;
+        T x, y;
+
+        memcpy(&x, source + last * step, size);
+        memcpy(&y, destination + last * step, size);
+        Alu<T, CMP>(x, y);
         break;
     }
     default:
-        fprintf(stdout, "Check sign not implemented\n");
+    {
+        if (sizeof(T) == 1 && !down && prefix == REPNE)
+        {
+            unsigned char *found = (unsigned char *)memchr(destination, *accumulator, count);
+            done = found != NULL ? found - destination : count;
+        }
+        else
+        {
+            done = FindElement<T>((unsigned char *)accumulator, 0, destination, step, count, prefix == REPNE);
+        }
+
+        int last = done < count ? done++ : count - 1;
+        T y;
+
+        memcpy(&y, destination + last * step, size);
+        Alu<T, CMP>(*accumulator, y);
         break;
     }
-    return val;
+    }
+
+    if ((op & 0xFE) != STOSB && (op & 0xFE) != SCASB)
+        registers[SI].word += done * step;
+    if ((op & 0xFE) != LODSB)
+        registers[DI].word += done * step;
+
+    return done;
 }
 
-// Checks if the interrupt flag should be set
-bool DOSEmulator::CheckIfInterrupt(unsigned short val1, unsigned short val2, char operation)
+// Runs a string instruction with a REP, REPE or REPNE prefix until CX runs out or a compare ends it.
+// CX, SI and DI are updated once per run of elements that doesn't wrap around a segment
+template <typename T>
+void DOSEmulator::RepeatString(unsigned char op, unsigned char prefix)
 {
-    bool val = false;
-    switch (operation)
+    bool down = GetFlag(DF);
+    bool compare = (op & 0xFE) == CMPSB || (op & 0xFE) == SCASB;
+
+    while (registers[CX].word != 0)
     {
-    default:
-        fprintf(stdout, "Check interrupt not implemented\n");
-        break;
+        int count = registers[CX].word;
+
+        if ((op & 0xFE) != STOSB && (op & 0xFE) != SCASB)
+            count = std::min(count, ElementsBeforeWrap(registers[SI].word, sizeof(T), down));
+        if ((op & 0xFE) != LODSB)
+            count = std::min(count, ElementsBeforeWrap(registers[DI].word, sizeof(T), down));
+
+        int done = count > 0 ? StringBulk<T>(op, prefix, count, down) : 0;
+
+        if (done == 0)
+        {
+            StringStep<T>(op);
+            done = 1;
+        }
+
+        registers[CX].word -= done;
+
+        // REPE goes on while the elements are equal and REPNE while they differ
+        if (compare && GetFlag(ZF) != (prefix == REPE))
+            break;
     }
-    return val;
 }
 
-// Checks if the direction flag should be set
-bool DOSEmulator::CheckIfDirection(unsigned short val1, unsigned short val2, char operation)
+// Gets where a store of size bytes goes like StoreAddress, for the bulk string instructions.
+// Returns NULL when part of it is ROM, the caller then stores element by element
+unsigned char *DOSEmulator::StoreRange(unsigned char *address, int size)
 {
-    bool val = false;
-    switch (operation)
-    {
-    default:
-        fprintf(stdout, "Check direction not implemented\n");
-        break;
-    }
-    return val;
+    int linear = address - memory;
+    unsigned char type = PAGE_RAM;
+
+    for (int page = linear >> MEMORY_PAGE_SHIFT; page <= (linear + size - 1) >> MEMORY_PAGE_SHIFT; page++)
+        type |= page_types[page & (MEMORY_PAGE_COUNT - 1)];
+
+    if (type & PAGE_ROM)
+        return NULL;
+
+    if (type & PAGE_CODE)
+        MarkWritten(linear, size);
+
+    if (type & PAGE_VIDEO)
+        MarkScanlines(linear, size);
+
+    if ((type & PAGE_WATCH) && CheckIfWatched(linear, size))
+        debug = true;
+
+    return address;
 }
 
-// Checks if the overflow flag should be set
-bool DOSEmulator::CheckIfOverflow(unsigned short val1, unsigned short val2, char operation)
+// Checks if the carry flag should be set
+bool DOSEmulator::CheckIfCarry()
 {
-    bool val = false;
-    switch (operation)
-    {
-    case SUBTRACTION:
-    {
-        if ((val1 - val2) > val1)
-            val = true;
-        break;
-    }
-    case ADDITION:
-    {
-        if ((val1 + val2) < val1 || (val1 + val2) < val2)
-            val = true;
-        break;
-    }
+    // The borrow of a subtraction wraps the result so the bit above the width is set as well
+    switch (lazy_flags.operation)
+    {
+    case LOGIC:
+        return false;
+    case INCREMENT:
+    case DECREMENT:
+        return flags[CF];
+    case SHIFT_RIGHT:
+        return lazy_flags.val1 & 0x1;
     default:
-        fprintf(stdout, "Check overflow not implemented\n");
-        break;
+        return (lazy_flags.result >> (lazy_flags.width * 8)) & 0x1;
     }
-    return val;
 }
 
-// Updates the flags based on the operation
-void DOSEmulator::UpdateFlags(unsigned short val1, unsigned short val2, char operation)
+// Checks if the parity flag should be set, only the low byte of the result counts
+bool DOSEmulator::CheckIfParity()
 {
+    unsigned char val = lazy_flags.result & 0xFF;
+
+    val ^= val >> 4;
+    val ^= val >> 2;
+    val ^= val >> 1;
 
-    flags[CF] = CheckIfCarry(val1, val2, operation);
-    // flags[PF] = CheckIfParity(val1, val2, operation);
-    // flags[AF] = CheckIfAuxiliary(val1, val2, operation);
-    flags[ZF] = CheckIfZero(val1, val2, operation);
-    flags[SF] = CheckIfSign(val1, val2, operation);
-    // flags[IF] = CheckIfInterrupt(val1, val2, operation);
-    // flags[DF] = CheckIfDirection(val1, val2, operation);
-    flags[OF] = CheckIfOverflow(val1, val2, operation);
+    return !(val & 0x1);
 }
 
-// Checks if the carry flag should be set 8 bit
-bool DOSEmulator::CheckIfCarry8(unsigned char val1, unsigned char val2, char operation)
+// Checks if the auxiliary flag should be set
+bool DOSEmulator::CheckIfAuxiliary()
 {
-    
-    bool val = false;
-    switch (operation)
-    {
-    case SUBTRACTION:
-    {
-        // If the first bit is 0 and then becomes 1 we had to carry
-        if (!(val2 & 0x8) && ((val2 - val1) & 0x8) == 8)
-            val = true;
-        break;
-    }
-    case ADDITION:
-    {
-        // If the first bit is 1 and then becomes 0 we had to carry
-        if ((val2 & 0x8) == 8 && !((val2 + val1) & 0x8))
-            val = true;
-        break;
-    }
-    default:
-        fprintf(stdout, "Check carry not implemented\n");
-        break;
-    }
-    return val;
+    if (lazy_flags.operation == LOGIC || lazy_flags.operation == SHIFT_RIGHT)
+        return false;
+
+    return (lazy_flags.val1 ^ lazy_flags.val2 ^ lazy_flags.result) & 0x10;
 }
 
-// Checks if the parity flag should be set 8 bit
-bool DOSEmulator::CheckIfParity8(unsigned char val1, unsigned char val2, char operation)
+// Checks if the zero flag should be set
+bool DOSEmulator::CheckIfZero()
 {
-    
+    return !(lazy_flags.result & (lazy_flags.width == 2 ? 0xFFFF : 0xFF));
 }
 
-// Checks if the auxiliary flag should be set 8 bit
-bool DOSEmulator::CheckIfAuxiliary8(unsigned char val1, unsigned char val2, char operation)
+// Checks if the sign flag should be set
+bool DOSEmulator::CheckIfSign()
 {
-    
+    return lazy_flags.result & (lazy_flags.width == 2 ? 0x8000 : 0x80);
 }
 
-// Checks if the zero flag should be set 8 bit
-bool DOSEmulator::CheckIfZero8(unsigned char val1, unsigned char val2, char operation)
+// Checks if the overflow flag should be set
+bool DOSEmulator::CheckIfOverflow()
 {
+    unsigned int sign = lazy_flags.width == 2 ? 0x8000 : 0x80;
 
-    bool val = false;
-    switch (operation)
+    switch (lazy_flags.operation)
     {
-    case SUBTRACTION:
-    {
-        if (!(val2 - val1))
-            val = true;
-        break;
-    }
     case ADDITION:
-    {
-        if (!(val2 + val1))
-            val = true;
-        break;
-    }
-    case XOR:
-    {
-        if (!(val2 ^ val1))
-            val = true;
-        break;
-    }
+    case INCREMENT:
+        return (lazy_flags.val1 ^ lazy_flags.result) & (lazy_flags.val2 ^ lazy_flags.result) & sign;
+    case SUBTRACTION:
+    case DECREMENT:
+        return (lazy_flags.val1 ^ lazy_flags.val2) & (lazy_flags.val1 ^ lazy_flags.result) & sign;
+    case SHIFT_RIGHT:
+        // A shift by one sets OF to the sign the operand had
+        return lazy_flags.val1 & sign;
     default:
-        fprintf(stdout, "Check zero not implemented\n");
-        break;
+        return false;
     }
-    return val;
 }
 
-// Checks if the sign flag should be set 8 bit
-bool DOSEmulator::CheckIfSign8(unsigned char val1, unsigned char val2, char operation)
+// Gets a flag, computing it from the last arithmetic instruction if needed
+inline bool DOSEmulator::GetFlag(unsigned char flag)
 {
-
-    bool val = false;
-    switch (operation)
-    {
-    case SUBTRACTION:
-    {
-        if ((char)(val1 - val2) < 0)
-            val = true;
-        break;
-    }
-    case ADDITION:
-    {
-        if ((char)(val1 + val2) < 0)
-            val = true;
-        break;
-    }
-    case XOR:
-    {
-        if ((char)(val1 ^ val2) < 0)
-            val = true;
-        break;
-    }
+    if (!lazy_flags.pending)
+        return flags[flag];
+
+    switch (flag)
+    {
+    case CF:
+        return CheckIfCarry();
+    case PF:
+        return CheckIfParity();
+    case AF:
+        return CheckIfAuxiliary();
+    case ZF:
+        return CheckIfZero();
+    case SF:
+        return CheckIfSign();
+    case OF:
+        return CheckIfOverflow();
     default:
-        fprintf(stdout, "Check sign not implemented\n");
-        break;
+        return flags[flag];
     }
-    return val;
 }
 
-// Checks if the interrupt flag should be set 8 bit
-bool DOSEmulator::CheckIfInterrupt8(unsigned char val1, unsigned char val2, char operation)
+// Sets a single flag, the pending flags are resolved first so the others are kept
+void DOSEmulator::SetFlag(unsigned char flag, bool val)
 {
-    
+    ResolveFlags();
+    flags[flag] = val;
 }
 
-// Checks if the direction flag should be set 8 bit
-bool DOSEmulator::CheckIfDirection8(unsigned char val1, unsigned char val2, char operation)
+// Computes all of the pending arithmetic flags into the flags array
+void DOSEmulator::ResolveFlags()
 {
-    
+    if (!lazy_flags.pending)
+        return;
+
+    flags[CF] = CheckIfCarry();
+    flags[PF] = CheckIfParity();
+    flags[AF] = CheckIfAuxiliary();
+    flags[ZF] = CheckIfZero();
+    flags[SF] = CheckIfSign();
+    flags[OF] = CheckIfOverflow();
+
+    lazy_flags.pending = false;
 }
 
-// Checks if the overflow flag should be set 8 bit
-bool DOSEmulator::CheckIfOverflow8(unsigned char val1, unsigned char val2, char operation)
+// Packs the flags into the 8086 flags register layout
+short DOSEmulator::GetFlagsWord()
 {
+    ResolveFlags();
 
-    bool val = false;
-    switch (operation)
-    {
-    case SUBTRACTION:
-    {
-        if ((val1 - val2) > val1)
-            val = true;
-        break;
-    }
-    case ADDITION:
-    {
-        if ((val1 + val2) < val1 || (val1 + val2) < val2)
-            val = true;
-        break;
-    }
-    default:
-        fprintf(stdout, "Check overflow not implemented\n");
-        break;
-    }
-    return val;
+    return (flags[CF] << 0) | (1 << 1) | (flags[PF] << 2) | (flags[AF] << 4) | (flags[ZF] << 6) |
+           (flags[SF] << 7) | (flags[IF] << 9) | (flags[DF] << 10) | (flags[OF] << 11);
 }
 
-// Update flags 8 bit
-void DOSEmulator::UpdateFlags8(unsigned char val1, unsigned char val2, char operation)
+// Unpacks the 8086 flags register layout into the flags
+void DOSEmulator::SetFlagsWord(short val)
 {
-
-    flags[CF] = CheckIfCarry8(val1, val2, operation);
-    // flags[PF] = CheckIfParity8(val1, val2, operation);
-    // flags[AF] = CheckIfAuxiliary8(val1, val2, operation);
-    flags[ZF] = CheckIfZero8(val1, val2, operation);
-    flags[SF] = CheckIfSign8(val1, val2, operation);
-    // flags[IF] = CheckIfInterrupt8(val1, val2, operation);
-    // flags[DF] = CheckIfDirection8(val1, val2, operation);
-    flags[OF] = CheckIfOverflow8(val1, val2, operation);
+    lazy_flags.pending = false;
+
+    flags[CF] = (val >> 0) & 0x1;
+    flags[PF] = (val >> 2) & 0x1;
+    flags[AF] = (val >> 4) & 0x1;
+    flags[ZF] = (val >> 6) & 0x1;
+    flags[SF] = (val >> 7) & 0x1;
+    flags[IF] = (val >> 9) & 0x1;
+    flags[DF] = (val >> 10) & 0x1;
+    flags[OF] = (val >> 11) & 0x1;
 }
 
 // Get all of the tokens from user input
@@ -1635,1517 +1203,1688 @@ std::vector<char *> GetTokens(char *line)
     return tokens;
 }
 
-// Debug menu
-void DOSEmulator::DebugMenu()
+// Runs one debugger command line while stopped at STOP_BREAKPOINT, returns true once the
+// command resumes the program and RunFor should be called again
+bool DOSEmulator::DebugCommand(char *line)
 {
-    fprintf(stdout, "Total Instructions executed: %d\n", instr_executed);
+    std::vector<char *> commands = GetTokens(line);
 
-    char *data_from_stdin = read_async();
+    if (commands.empty())
+        return false;
 
-    while (strcmp(data_from_stdin, "n") & strcmp(data_from_stdin, "next"))
-    {
-        std::vector<char *> commands = GetTokens(data_from_stdin);
+    char *command = commands[0];
 
-        char *command = commands[0];
+    if (!(strcmp(command, "n") & strcmp(command, "next")))
+    {
+        debug_resume = true;
+        return true;
+    }
+    else if (!(strcmp(command, "h") & strcmp(command, "help")))
+    {
+        fprintf(stdout, "Commands:\n");
+        fprintf(stdout, "\tnext (n):   Step to next instruction\n");
+        fprintf(stdout, "\tstatus (s): Prints status of registers and flags\n");
+        fprintf(stdout, "\tstep (st) <#>: Runs for # amount of instructions\n");
+        fprintf(stdout, "\tprint (p): Prints current address and opcode\n");
+        fprintf(stdout, "\tpm <#>: Prints memory at region (begin with 0x to display hex)\n");
+        fprintf(stdout, "\tb <#>: Sets breakpoint at address (begin with 0x to display hex)\n");
+        fprintf(stdout, "\tw <#>: Sets watchpoint that stops when the address is written (begin with 0x to display hex)\n");
+        fprintf(stdout, "\tc: Continue program execution\n");
+        fprintf(stdout, "\ttiers (t): Prints how many blocks and instructions ran in each tier\n");
+        fprintf(stdout, "\thelp (h):   Get a list of commands\n");
+    }
+    else if (!(strcmp(command, "s") & strcmp(command, "status")))
+    {
+        PrintStack();
+    }
+    else if (!(strcmp(command, "st") & strcmp(command, "step")))
+    {
+        step = instr_executed + atoi(commands[1]);
+        debug = false;
+        debug_resume = true;
+        return true;
+    }
+    else if (!(strcmp(command, "p") & strcmp(command, "print")))
+    {
+        fprintf(stdout, "Current Address: %04x\tCurrent opcode: %02x\n", ip + startAddress, opcodes[ip]);
+    }
+    else if (!strcmp(command, "pm"))
+    {
+        int start;
 
-        if (!(strcmp(command, "h") & strcmp(command, "help")))
-        {
-            fprintf(stdout, "Commands:\n");
-            fprintf(stdout, "\tnext (n):   Step to next instruction\n");
-            fprintf(stdout, "\tstatus (s): Prints status of registers and flags\n");
-            fprintf(stdout, "\tstep (st) <#>: Runs for # amount of instructions\n");
-            fprintf(stdout, "\tprint (p): Prints current address and opcode\n");
-            fprintf(stdout, "\tpm <#>: Prints memory at region (begin with 0x to display hex)\n");
-            fprintf(stdout, "\tb <#>: Sets breakpoint at address (begin with 0x to display hex)\n");
-            fprintf(stdout, "\tc: Continue program execution\n");
-            fprintf(stdout, "\thelp (h):   Get a list of commands\n");
-        }
-        else if (!(strcmp(command, "s") & strcmp(command, "status")))
+        if (commands[1][0] == '0' && commands[1][1] == 'x')
         {
-            PrintStack();
+            start = (int)strtol(commands[1], NULL, 16);
         }
-        else if (!(strcmp(command, "st") & strcmp(command, "step")))
+        else
         {
-            step = instr_executed + atoi(commands[1]);
-            debug = false;
-            break;
+            start = atoi(commands[1]);
         }
-        else if (!(strcmp(command, "p") & strcmp(command, "print")))
+
+        if (start < 0 || start >= MEMORY_SIZE + MEMORY_SLACK)
         {
-            fprintf(stdout, "Current Address: %04x\tCurrent opcode: %02x\n", ip - 1 + startAddress, opcodes[ip - 1]);
+            fprintf(stdout, "Address %x is outside of memory\n", start);
         }
-        else if (!strcmp(command, "pm"))
+        else
         {
-            int start;
+            // The 80 bytes shown end at the last byte of memory at the latest
+            start = std::min(start, MEMORY_SIZE + MEMORY_SLACK - 5 * 16);
 
-            if (commands[1][0] == '0' && commands[1][1] == 'x')
-            {
-                start = (int)strtol(commands[1], NULL, 16);
-            }
-            else
-            {
-                start = atoi(commands[1]);
-            }
             fprintf(stdout, "Memory from %04x:\n", start);
 
             for (int i = 0; i < 5; i++)
             {
                 for (int j = 0; j < 16; j++)
                 {
-                    fprintf(stdout, "%02x ", data[start + j + (i * 16)]);
+                    fprintf(stdout, "%02x ", memory[start + j + (i * 16)]);
                 }
                 fprintf(stdout, "\n");
             }
         }
-        else if (!strcmp(command, "b"))
-        {
-            int start;
+    }
+    else if (!strcmp(command, "b"))
+    {
+        int start;
 
-            if (commands[1][0] == '0' && commands[1][1] == 'x')
-            {
-                start = (int)strtol(commands[1], NULL, 16);
-            }
-            else
-            {
-                start = atoi(commands[1]);
-            }
+        if (commands[1][0] == '0' && commands[1][1] == 'x')
+        {
+            start = (int)strtol(commands[1], NULL, 16);
+        }
+        else
+        {
+            start = atoi(commands[1]);
+        }
 
-            breakpoints.push_back(start);
+        if (start < 0 || start >= ADDRESS_MAP_SIZE * 8)
+        {
+            fprintf(stdout, "Address %x is outside of memory\n", start);
         }
-        else if (!(strcmp(command, "c") & strcmp(command, "cont")))
+        else if (!(breakpoint_map[start >> 3] & (1 << (start & 0x7))))
         {
-            debug = false;
-            break;
+            // Breakpoints are never cleared and any of them keeps the run in the debug loop, which
+            // doesn't enter compiled code, so no chained block can run past one
+            breakpoint_map[start >> 3] |= 1 << (start & 0x7);
+            breakpoint_count++;
+        }
+    }
+    else if (!strcmp(command, "w"))
+    {
+        int start;
+
+        if (commands[1][0] == '0' && commands[1][1] == 'x')
+        {
+            start = (int)strtol(commands[1], NULL, 16);
         }
         else
         {
-            printf("Command %s not found, type h or help for list of commands\n", data_from_stdin);
+            start = atoi(commands[1]);
         }
 
-        data_from_stdin = read_async();
+        if (start < 0 || start >= ADDRESS_MAP_SIZE * 8)
+        {
+            fprintf(stdout, "Address %x is outside of memory\n", start);
+        }
+        else if (!(watchpoint_map[start >> 3] & (1 << (start & 0x7))))
+        {
+            watchpoint_map[start >> 3] |= 1 << (start & 0x7);
+            page_types[(start >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGE_COUNT - 1)] |= PAGE_WATCH;
+            watchpoint_count++;
+        }
+    }
+    else if (!(strcmp(command, "t") & strcmp(command, "tiers")))
+    {
+        PrintTierStats();
+    }
+    else if (!(strcmp(command, "c") & strcmp(command, "cont")))
+    {
+        debug = false;
+        debug_resume = true;
+        return true;
+    }
+    else
+    {
+        printf("Command %s not found, type h or help for list of commands\n", command);
     }
+
+    return false;
 }
 
 // push 16 bit value onto stack
 void DOSEmulator::Push(short val)
 {
-    short sp_offset = (registers[SP][0] << 8) + registers[SP][1];
+    unsigned short sp_offset = registers[SP].word - 2;
 
-    data[--sp_offset + (header->hdrsize * 16)] = val & 0xFF;
-    data[--sp_offset + (header->hdrsize * 16)] = (val >> 8) & 0xFF;
+    *StoreAddress(GetDataStart(SS) + sp_offset, 1) = val & 0xFF;
+    *StoreAddress(GetDataStart(SS) + (unsigned short)(sp_offset + 1), 1) = (val >> 8) & 0xFF;
 
-    registers[SP][0] = (sp_offset >> 8) & 0xFF;
-    registers[SP][1] = sp_offset & 0xFF;
+    registers[SP].word = sp_offset;
 }
 
-// push 8 bit value onto stack
-void DOSEmulator::Push8(char val)
+// pop 16 bit value from stack
+short DOSEmulator::Pop()
 {
-    short sp_offset = (registers[SP][0] << 8) + registers[SP][1];
+    unsigned short sp_offset = registers[SP].word;
+
+    short val = GetDataStart(SS)[sp_offset] + (GetDataStart(SS)[(unsigned short)(sp_offset + 1)] << 8);
+    sp_offset += 2;
 
-    data[--sp_offset + (header->hdrsize * 16)] = val;
+    registers[SP].word = sp_offset;
 
-    registers[SP][0] = (sp_offset >> 8) & 0xFF;
-    registers[SP][1] = sp_offset & 0xFF;
+    return val;
 }
 
-// pop 16 bit value from stack
-short DOSEmulator::Pop()
+// check if a breakpoint is set
+bool DOSEmulator::CheckIfBreakpoint()
 {
-    short sp_offset = (registers[SP][0] << 8) + registers[SP][1];
+    int address = ip + startAddress;
 
-    short val = ((data[sp_offset++ + (header->hdrsize * 16)] << 8) & 0xFF) +
-                data[sp_offset++ + (header->hdrsize * 16)];
+    return breakpoint_map[address >> 3] & (1 << (address & 0x7));
+}
+
+// Checks if a store of size bytes at a linear address writes a watchpoint
+bool DOSEmulator::CheckIfWatched(int address, int size)
+{
+    for (int i = address; i < address + size; i++)
+    {
+        if (watchpoint_map[i >> 3] & (1 << (i & 0x7)))
+        {
+            fprintf(stdout, "Watchpoint at %05x written\n", i);
+            return true;
+        }
+    }
+    return false;
+}
 
-    registers[SP][0] = (sp_offset >> 8) & 0xFF;
-    registers[SP][1] = sp_offset & 0xFF;
+// Checks if anything needs the instrumented run loop: the debug menu, breakpoints, watchpoints or a step count
+bool DOSEmulator::DebugArmed()
+{
+    return debug || breakpoint_count > 0 || watchpoint_count > 0 || step > instr_executed;
+}
 
-    return val;
+// Operand format of every opcode, used by the decoder to find the instruction length
+static const unsigned char opcode_formats[256] = {
+    // 0x00 - 0x0f
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE,
+    // 0x10 - 0x1f
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE,
+    // 0x20 - 0x2f
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE,
+    // 0x30 - 0x3f
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE,
+    // 0x40 - 0x4f
+    FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    // 0x50 - 0x5f
+    FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    // 0x60 - 0x6f
+    FORMAT_NONE, FORMAT_NONE, FORMAT_MODRM, FORMAT_MODRM, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_IMM16, FORMAT_MODRM | FORMAT_IMM16, FORMAT_IMM8, FORMAT_MODRM | FORMAT_IMM8, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    // 0x70 - 0x7f
+    FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8,
+    FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8,
+    // 0x80 - 0x8f
+    FORMAT_MODRM | FORMAT_IMM8, FORMAT_MODRM | FORMAT_IMM16, FORMAT_MODRM | FORMAT_IMM8, FORMAT_MODRM | FORMAT_IMM8,
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM,
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM,
+    // 0x90 - 0x9f
+    FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_NONE, FORMAT_NONE, FORMAT_FAR, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    // 0xa0 - 0xaf
+    FORMAT_IMM16, FORMAT_IMM16, FORMAT_IMM16, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    // 0xb0 - 0xbf
+    FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8,
+    FORMAT_IMM16, FORMAT_IMM16, FORMAT_IMM16, FORMAT_IMM16, FORMAT_IMM16, FORMAT_IMM16, FORMAT_IMM16, FORMAT_IMM16,
+    // 0xc0 - 0xcf
+    FORMAT_MODRM | FORMAT_IMM8, FORMAT_MODRM | FORMAT_IMM8, FORMAT_IMM16, FORMAT_NONE,
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM | FORMAT_IMM8, FORMAT_MODRM | FORMAT_IMM16,
+    FORMAT_IMM16 | FORMAT_IMM8, FORMAT_NONE, FORMAT_IMM16, FORMAT_NONE, FORMAT_NONE, FORMAT_IMM8, FORMAT_NONE, FORMAT_NONE,
+    // 0xd0 - 0xdf
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_IMM8, FORMAT_IMM8, FORMAT_NONE, FORMAT_NONE,
+    FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM, FORMAT_MODRM,
+    // 0xe0 - 0xef
+    FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8, FORMAT_IMM8,
+    FORMAT_IMM16, FORMAT_IMM16, FORMAT_FAR, FORMAT_IMM8, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE,
+    // 0xf0 - 0xff
+    FORMAT_NONE, FORMAT_NONE, FORMAT_PREFIX, FORMAT_PREFIX, FORMAT_NONE, FORMAT_NONE, FORMAT_MODRM | FORMAT_GROUP3, FORMAT_MODRM | FORMAT_GROUP3,
+    FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_NONE, FORMAT_MODRM, FORMAT_MODRM,
+};
+
+// Empties every slot of the decode cache
+void DOSEmulator::ClearDecodeCache()
+{
+    for (int i = 0; i < DECODE_CACHE_SIZE; i++)
+        decode_cache[i].address = -1;
 }
 
-// pop 8 bit value from stack
-char DOSEmulator::Pop8()
+// Decodes the instruction at a linear address into a cache record
+void DOSEmulator::DecodeInstruction(int address, DECODED_INSTR *instr)
 {
-    short sp_offset = (registers[SP][0] << 8) + registers[SP][1];
+    unsigned char *code = memory + address;
+    int len = 0;
 
-    char val = data[sp_offset++ + (header->hdrsize * 16)];
+    instr->address = address;
+    instr->generation = page_generation[(address >> CODE_PAGE_SHIFT) & (CODE_PAGE_COUNT - 1)];
+    page_types[(address >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGE_COUNT - 1)] |= PAGE_CODE;
+    instr->op = code[len++];
+    instr->format = opcode_formats[instr->op];
+    instr->width = (instr->op >= 0xb0 && instr->op <= 0xbf) ? ((instr->op & 0x8) ? 2 : 1) : ((instr->op & 0x1) ? 2 : 1);
 
-    registers[SP][0] = (sp_offset >> 8) & 0xFF;
-    registers[SP][1] = sp_offset & 0xFF;
+    // INC and DEC of a register always take a word
+    if (instr->op >= 0x40 && instr->op <= 0x4f)
+        instr->width = 2;
+    instr->reg = instr->op & 0x7;
+    instr->modrm = 0;
+    instr->disp = 0;
+    instr->imm = 0;
+    instr->imm2 = 0;
 
-    return val;
+    // The prefixed opcode gets stored as the immediate
+    if (instr->format & FORMAT_PREFIX)
+        instr->imm = code[len++];
+
+    if (instr->format & FORMAT_MODRM)
+    {
+        instr->modrm = code[len++];
+        instr->reg = GetRegister(instr->modrm);
+
+        if (modrm_table.entries[instr->modrm].disp_size == 1)
+        {
+            instr->disp = (char)code[len++];
+        }
+        else if (modrm_table.entries[instr->modrm].disp_size == 2)
+        {
+            instr->disp = code[len] + (code[len + 1] << 8);
+            len += 2;
+        }
+    }
+
+    // Group 3 only carries an immediate for TEST
+    if ((instr->format & FORMAT_GROUP3) && instr->reg == 0)
+        instr->format |= (instr->width == 2) ? FORMAT_IMM16 : FORMAT_IMM8;
+
+    if (instr->format & FORMAT_IMM16)
+    {
+        instr->imm = code[len] + (code[len + 1] << 8);
+        len += 2;
+
+        if (instr->format & FORMAT_IMM8)
+            instr->imm2 = code[len++];
+    }
+    else if (instr->format & FORMAT_IMM8)
+    {
+        instr->imm = (char)code[len++];
+    }
+    else if (instr->format & FORMAT_FAR)
+    {
+        instr->imm = code[len] + (code[len + 1] << 8);
+        instr->imm2 = code[len + 2] + (code[len + 3] << 8);
+        len += 4;
+    }
+
+    instr->length = len;
+
+    // An instruction running into the next page is watched there too
+    page_types[((address + len - 1) >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGE_COUNT - 1)] |= PAGE_CODE;
+
+    for (int i = address; i < address + len; i++)
+        decoded_map[(i & (MEMORY_SIZE - 1)) >> 3] |= 1 << (i & 0x7);
+
+#ifdef JIT_SUPPORTED
+    instr->block_end = EndsJitBlock(instr);
+#else
+    instr->block_end = true;
+#endif
 }
 
-// check if a breakpoint is set
-bool DOSEmulator::CheckIfBreakpoint(char op)
+// Gets the decoded instruction at the instruction pointer, decoding it on a cache miss
+inline DECODED_INSTR *DOSEmulator::FetchInstruction()
+{
+    int address = startAddress + ip;
+    DECODED_INSTR *instr = &decode_cache[address & (DECODE_CACHE_SIZE - 1)];
+
+    // A store into the page since the record was decoded makes it stale
+    if (instr->address != address || instr->generation != page_generation[(address >> CODE_PAGE_SHIFT) & (CODE_PAGE_COUNT - 1)])
+        DecodeInstruction(address, instr);
+
+    return instr;
+}
+
+// With THREADED_DISPATCH every opcode body is a label in a computed goto table and
+// ends by fetching and jumping straight to the next handler, otherwise the bodies
+// are cases of the switch and share the loop tail. The debug loop and the JIT do
+// their work at the loop head, so there the threaded tail goes back to it
+#ifdef THREADED_DISPATCH
+#define TARGET(op) op_##op:
+#define DISPATCH()                           \
+    {                                        \
+        instr_executed++;                    \
+        if (Debug && instr_executed == step) \
+            debug = true;                    \
+        if (instr_executed >= stop_at)       \
+            return;                          \
+        if (Debug || jit_enabled)            \
+            continue;                        \
+        instr = FetchInstruction();          \
+        instr_ip = ip;                       \
+        ip += instr->length;                 \
+        goto *opcode_targets[instr->op];     \
+    }
+#else
+#define TARGET(op) case op:
+#define DISPATCH() break
+#endif
+
+// Runs the program for up to budget instructions and returns why it stopped. Compiled blocks
+// only stop between blocks, so a budget can run over by what one call into them runs
+int DOSEmulator::RunFor(long long budget)
 {
-    for (int i : breakpoints)
+    if (!run)
+        return STOP_EXIT;
+
+    stop_reason = STOP_BUDGET;
+    stop_at = instr_executed + budget;
+
+    // The debug loop hands back once nothing is armed anymore, the other one when the budget is used up
+    while (stop_reason == STOP_BUDGET && instr_executed < stop_at)
     {
-        if (ip - 1 + startAddress == i)
-            return true;
+        if (DebugArmed())
+            RunLoop<true>();
+        else
+            RunLoop<false>();
     }
-    return false;
+
+    // Whatever the program sent the host during the run goes out in one transfer
+    FlushCommands();
+
+    // The host only needs to present a frame when the display changed during the run
+    if (stop_reason == STOP_BUDGET && video_dirty)
+        return STOP_FRAME;
+
+    return stop_reason;
 }
 
-// runs the code
-void DOSEmulator::RunCode()
+// Runs the interpreter until the instruction count reaches stop_at. Debug checks for breakpoints,
+// watchpoints and the step count and stops for the debugger, and returns when none of them are
+// armed. Without it there are no checks
+template <bool Debug>
+void DOSEmulator::RunLoop()
 {
+#ifdef THREADED_DISPATCH
+#include "opcode_targets.h"
+#endif
 
-    int instr_count = 0;
+    DECODED_INSTR *instr;
 
-    instr_executed = 0;
-    opcodes = data + startAddress;
-    run = true;
+    while (instr_executed < stop_at)
+    {
+        if (Debug)
+        {
+            // The instruction the debugger resumed at runs before anything is checked again
+            if (!debug_resume)
+            {
+                if (CheckIfBreakpoint())
+                    debug = true;
 
-    ClearFlags();
+                if (debug)
+                {
+                    FlushCommands();
+                    fprintf(stdout, "Total Instructions executed: %lld\n", instr_executed);
+                    stop_reason = STOP_BREAKPOINT;
+                    return;
+                }
+            }
 
-    SetRegistersFromHeader();
+            debug_resume = false;
 
-    unsigned char op = opcodes[ip++];
+            if (!DebugArmed())
+                return;
+        }
 
-    while (run)
-    {
+#ifdef JIT_SUPPORTED
+        // A compiled block runs whole, the interpreter only takes the instructions it stops at.
+        // Blocks can't stop in the middle for the debugger, so the debug loop leaves them alone.
+        // Blocks only start where one ended, so the instructions inside them aren't counted as blocks
+        if (!Debug && jit_enabled && jit_block_head && RunJitBlock())
+            continue;
+#endif
 
-        if (CheckIfBreakpoint(op))
-            debug = true;
+        // Execute from the decoded record, the byte stream is only read on a cache miss. ip moves past
+        // the instruction before it runs, instr_ip keeps where it started for the fault report
+        instr = FetchInstruction();
+        instr_ip = ip;
+        ip += instr->length;
 
-        if (debug)
-            DebugMenu();
+#ifdef JIT_SUPPORTED
+        // A branch, call, return or anything the compiler stops at makes the next instruction a block head
+        if (!Debug)
+            jit_block_head = instr->block_end;
+#endif
 
-        switch (op)
+#ifdef THREADED_DISPATCH
+        goto *opcode_targets[instr->op];
+#else
+        switch (instr->op)
+#endif
         {
-        case 0x0:
+        TARGET(0x00)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, ADD, false>(instr);
+            DISPATCH();
         }
-        case 0x1:
+        TARGET(0x01)
         {
-            op = opcodes[ip++];
-            short val1 = GetModMemVal(op, false);
-            short val2 = (registers[GetRegister(op)][0] << 8) + registers[GetRegister(op)][1];
-            UpdateFlags(val1, val2, ADDITION);
-            SetModMemVal(val1 + val2, op, true);
-
-            break;
+            AluModRM<unsigned short, ADD, false>(instr);
+            DISPATCH();
         }
-        case 0x2:
+        TARGET(0x02)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, ADD, true>(instr);
+            DISPATCH();
         }
-        case 0x3:
+        TARGET(0x03)
         {
-            op = opcodes[ip++];
-            short val1 = (registers[GetRegister(op)][0] << 8) + registers[GetRegister(op)][1];
-            short val2 = GetModMemVal(op, true);
-            UpdateFlags(val1, val2, ADDITION);
-
-            short result = val1 + val2;
-
-            registers[GetRegister(op)][0] = (result >> 8) & 0xFF;
-            registers[GetRegister(op)][1] = result & 0xFF;
-
-            break;
+            AluModRM<unsigned short, ADD, true>(instr);
+            DISPATCH();
         }
-        case 0x4:
+        TARGET(0x04)
         {
-            char val = opcodes[ip++];
-
-            UpdateFlags8(registers[AX][AL], val, ADDITION);
-            registers[AX][AL] += val;
-
-            break;
+            AluAccumulator<unsigned char, ADD>(instr);
+            DISPATCH();
         }
-        case 0x5:
+        TARGET(0x05)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, ADD>(instr);
+            DISPATCH();
         }
-        case 0x6:
+        TARGET(0x06)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            Push(special_registers[ES].word);
+            DISPATCH();
         }
-        case 0x7:
+        TARGET(0x07)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            SetSegment(ES, Pop());
+            DISPATCH();
         }
-        case 0x8:
+        TARGET(0x08)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, OR, false>(instr);
+            DISPATCH();
         }
-        case 0x9:
+        TARGET(0x09)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, OR, false>(instr);
+            DISPATCH();
         }
-        case 0xa:
+        TARGET(0x0a)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, OR, true>(instr);
+            DISPATCH();
         }
-        case 0xb:
+        TARGET(0x0b)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, OR, true>(instr);
+            DISPATCH();
         }
-        case 0xc:
+        TARGET(0x0c)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned char, OR>(instr);
+            DISPATCH();
         }
-        case 0xd:
+        TARGET(0x0d)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, OR>(instr);
+            DISPATCH();
         }
-        case 0xe:
+        TARGET(0x0e)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            Push(special_registers[CS].word);
+            DISPATCH();
         }
-        case 0xf:
+        TARGET(0x0f)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x10:
+        TARGET(0x10)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, ADC, false>(instr);
+            DISPATCH();
         }
-        case 0x11:
+        TARGET(0x11)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, ADC, false>(instr);
+            DISPATCH();
         }
-        case 0x12:
+        TARGET(0x12)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, ADC, true>(instr);
+            DISPATCH();
         }
-        case 0x13:
+        TARGET(0x13)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, ADC, true>(instr);
+            DISPATCH();
         }
-        case 0x14:
+        TARGET(0x14)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned char, ADC>(instr);
+            DISPATCH();
         }
-        case 0x15:
+        TARGET(0x15)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, ADC>(instr);
+            DISPATCH();
         }
-        case 0x16:
+        TARGET(0x16)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            Push(special_registers[SS].word);
+            DISPATCH();
         }
-        case 0x17:
+        TARGET(0x17)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            SetSegment(SS, Pop());
+            DISPATCH();
         }
-        case 0x18:
+        TARGET(0x18)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, SBB, false>(instr);
+            DISPATCH();
         }
-        case 0x19:
+        TARGET(0x19)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, SBB, false>(instr);
+            DISPATCH();
         }
-        case 0x1a:
+        TARGET(0x1a)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, SBB, true>(instr);
+            DISPATCH();
         }
-        case 0x1b:
+        TARGET(0x1b)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, SBB, true>(instr);
+            DISPATCH();
         }
-        case 0x1c:
+        TARGET(0x1c)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned char, SBB>(instr);
+            DISPATCH();
         }
-        case 0x1d:
+        TARGET(0x1d)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, SBB>(instr);
+            DISPATCH();
         }
-        case 0x1e:
+        TARGET(0x1e)
         {
-            Push((special_registers[DS][0] << 8) + special_registers[DS][1]);
-            break;
+            Push(special_registers[DS].word);
+            DISPATCH();
         }
-        case 0x1f:
+        TARGET(0x1f)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            SetSegment(DS, Pop());
+            DISPATCH();
         }
-        case 0x20:
+        TARGET(0x20)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, AND, false>(instr);
+            DISPATCH();
         }
-        case 0x21:
+        TARGET(0x21)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, AND, false>(instr);
+            DISPATCH();
         }
-        case 0x22:
+        TARGET(0x22)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, AND, true>(instr);
+            DISPATCH();
         }
-        case 0x23:
+        TARGET(0x23)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, AND, true>(instr);
+            DISPATCH();
         }
-        case 0x24:
+        TARGET(0x24)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned char, AND>(instr);
+            DISPATCH();
         }
-        case 0x25:
+        TARGET(0x25)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, AND>(instr);
+            DISPATCH();
         }
-        case 0x26:
+        TARGET(0x26)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x27:
+        TARGET(0x27)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x28:
+        TARGET(0x28)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, SUB, false>(instr);
+            DISPATCH();
         }
-        case 0x29:
+        TARGET(0x29)
         {
-            op = opcodes[ip++];
-
-            short val1 = GetModMemVal(op, false);
-            short val2 = (registers[GetRegister(op)][0] << 8) + registers[GetRegister(op)][1];
-
-            UpdateFlags(val1, val2, SUBTRACTION);
-
-            short result = val1 - val2;
-
-            SetModMemVal(val1 - val2, op, true);
-            break;
+            AluModRM<unsigned short, SUB, false>(instr);
+            DISPATCH();
         }
-        case 0x2a:
+        TARGET(0x2a)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, SUB, true>(instr);
+            DISPATCH();
         }
-        case 0x2b:
+        TARGET(0x2b)
         {
-            op = opcodes[ip++];
-
-            short val1 = (registers[GetRegister(op)][0] << 8) + registers[GetRegister(op)][1];
-            short val2 = GetModMemVal(op, true);
-
-            UpdateFlags(val1, val2, SUBTRACTION);
-
-            short result = val1 - val2;
-
-            registers[GetRegister(op)][0] = (result >> 8) & 0xFF;
-            registers[GetRegister(op)][1] = result & 0xFF;
-
-            break;
+            AluModRM<unsigned short, SUB, true>(instr);
+            DISPATCH();
         }
-        case 0x2c:
+        TARGET(0x2c)
         {
-            op = opcodes[ip++];
-            UpdateFlags8(registers[AX][AL], op, SUBTRACTION);
-
-            registers[AX][AL] -= (char)op;
-            break;
+            AluAccumulator<unsigned char, SUB>(instr);
+            DISPATCH();
         }
-        case 0x2d:
+        TARGET(0x2d)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, SUB>(instr);
+            DISPATCH();
         }
-        case 0x2e:
+        TARGET(0x2e)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x2f:
+        TARGET(0x2f)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x30:
+        TARGET(0x30)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, XOR, false>(instr);
+            DISPATCH();
         }
-        case 0x31:
+        TARGET(0x31)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, XOR, false>(instr);
+            DISPATCH();
         }
-        case 0x32:
+        TARGET(0x32)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, XOR, true>(instr);
+            DISPATCH();
         }
-        case 0x33:
+        TARGET(0x33)
         {
-            op = opcodes[ip++];
-            short val1 = (registers[GetRegister(op)][0] << 8) + registers[GetRegister(op)][1];
-            short val2 = GetModMemVal(op, true);
-            UpdateFlags(val1, val2, XOR);
-
-            short result = val1 ^ val2;
-
-            registers[GetRegister(op)][0] = (result >> 8) & 0xFF;
-            registers[GetRegister(op)][1] = result & 0xFF;
-            break;
+            AluModRM<unsigned short, XOR, true>(instr);
+            DISPATCH();
         }
-        case 0x34:
+        TARGET(0x34)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned char, XOR>(instr);
+            DISPATCH();
         }
-        case 0x35:
+        TARGET(0x35)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, XOR>(instr);
+            DISPATCH();
         }
-        case 0x36:
+        TARGET(0x36)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x37:
+        TARGET(0x37)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x38:
+        TARGET(0x38)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, CMP, false>(instr);
+            DISPATCH();
         }
-        case 0x39:
+        TARGET(0x39)
         {
-            op = opcodes[ip++];
-
-            short val2 = (registers[GetRegister(op) % 4][0] << 8) + registers[GetRegister(op) % 4][1];
-
-            UpdateFlags(GetModMemVal(op, true), val2, SUBTRACTION);
-
-            break;
+            AluModRM<unsigned short, CMP, false>(instr);
+            DISPATCH();
         }
-        case 0x3a:
+        TARGET(0x3a)
         {
-            op = opcodes[ip++];
-
-            UpdateFlags8(registers[GetRegister(op) % 4][GetRegister(op) <= 3], GetModMemVal8(op, true), SUBTRACTION);
-            break;
+            AluModRM<unsigned char, CMP, true>(instr);
+            DISPATCH();
         }
-        case 0x3b:
+        TARGET(0x3b)
         {
-            op = opcodes[ip++];
-
-            short val1 = (registers[GetRegister(op) % 4][0] << 8) + registers[GetRegister(op) % 4][1];
-
-            UpdateFlags(val1, GetModMemVal(op, true), SUBTRACTION);
-            break;
+            AluModRM<unsigned short, CMP, true>(instr);
+            DISPATCH();
         }
-        case 0x3c:
+        TARGET(0x3c)
         {
-            op = opcodes[ip++];
-
-            UpdateFlags8(registers[AX][AL], op, SUBTRACTION);
-
-            break;
+            AluAccumulator<unsigned char, CMP>(instr);
+            DISPATCH();
         }
-        case 0x3d:
+        TARGET(0x3d)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, CMP>(instr);
+            DISPATCH();
         }
-        case 0x3e:
+        TARGET(0x3e)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x3f:
+        TARGET(0x3f)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x40:
-        case 0x41:
-        case 0x42:
-        case 0x43:
-        case 0x44:
-        case 0x45:
-        case 0x46:
-        case 0x47:
-        {
-            char reg = op - 0x40;
-            short val = (registers[reg][0] << 8) + registers[reg][1] + 1;
-            registers[reg][0] = (val >> 8) & 0xFF;
-            registers[reg][1] = val & 0xFF;
-            break;
+        TARGET(0x40)
+        TARGET(0x41)
+        TARGET(0x42)
+        TARGET(0x43)
+        TARGET(0x44)
+        TARGET(0x45)
+        TARGET(0x46)
+        TARGET(0x47)
+        {
+            unsigned short *reg = RegisterOperand<unsigned short>(instr->reg);
+            *reg = IncDec<unsigned short, INC>(*reg);
+            DISPATCH();
         }
-        case 0x48:
-        case 0x49:
-        case 0x4a:
-        case 0x4b:
-        case 0x4c:
-        case 0x4d:
-        case 0x4e:
-        case 0x4f:
-        {
-            char reg = op - 0x40;
-            short val = (registers[reg][0] << 8) + registers[reg][1] - 1;
-            registers[reg][0] = (val >> 8) & 0xFF;
-            registers[reg][1] = val & 0xFF;
-            break;
+        TARGET(0x48)
+        TARGET(0x49)
+        TARGET(0x4a)
+        TARGET(0x4b)
+        TARGET(0x4c)
+        TARGET(0x4d)
+        TARGET(0x4e)
+        TARGET(0x4f)
+        {
+            unsigned short *reg = RegisterOperand<unsigned short>(instr->reg);
+            *reg = IncDec<unsigned short, DEC>(*reg);
+            DISPATCH();
         }
-        case 0x50:
-        case 0x51:
-        case 0x52:
-        case 0x53:
-        case 0x54:
-        case 0x55:
-        case 0x56:
-        case 0x57:
+        TARGET(0x50)
+        TARGET(0x51)
+        TARGET(0x52)
+        TARGET(0x53)
+        TARGET(0x54)
+        TARGET(0x55)
+        TARGET(0x56)
+        TARGET(0x57)
         {
-            Push((registers[op - 0x50][0] << 8) + registers[op - 0x50][1]);
-            break;
+            Push(registers[instr->reg].word);
+            DISPATCH();
         }
-        case 0x58:
-        case 0x59:
-        case 0x5a:
-        case 0x5b:
-        case 0x5c:
-        case 0x5d:
-        case 0x5e:
-        case 0x5f:
+        TARGET(0x58)
+        TARGET(0x59)
+        TARGET(0x5a)
+        TARGET(0x5b)
+        TARGET(0x5c)
+        TARGET(0x5d)
+        TARGET(0x5e)
+        TARGET(0x5f)
         {
             short val = Pop();
-            registers[op - 0x58][0] = (val >> 8) & 0xFF;
-            registers[op - 0x58][1] = val & 0xFF;
-            break;
+            registers[instr->reg].word = val;
+            DISPATCH();
         }
-        case 0x60:
+        TARGET(0x60)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x61:
+        TARGET(0x61)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x62:
+        TARGET(0x62)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x63:
+        TARGET(0x63)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x64:
+        TARGET(0x64)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x65:
+        TARGET(0x65)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x66:
+        TARGET(0x66)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x67:
+        TARGET(0x67)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x68:
+        TARGET(0x68)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x69:
+        TARGET(0x69)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x6a:
+        TARGET(0x6a)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x6b:
+        TARGET(0x6b)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x6c:
+        TARGET(0x6c)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x6d:
+        TARGET(0x6d)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x6e:
+        TARGET(0x6e)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x6f:
+        TARGET(0x6f)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x70:
+        TARGET(0x70)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x71:
+        TARGET(0x71)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x72:
+        TARGET(0x72)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x73:
+        TARGET(0x73)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x74:
+        TARGET(0x74)
         {
-            op = opcodes[ip++];
-            if (flags[ZF])
-                ip += (char)op;
-            break;
+            if (GetFlag(ZF))
+                ip += instr->imm;
+            DISPATCH();
         }
-        case 0x75:
+        TARGET(0x75)
         {
-            op = opcodes[ip++];
-            if (!flags[ZF])
-                ip += (char)op;
-            break;
+            if (!GetFlag(ZF))
+                ip += instr->imm;
+            DISPATCH();
         }
-        case 0x76:
+        TARGET(0x76)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x77:
+        TARGET(0x77)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x78:
+        TARGET(0x78)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x79:
+        TARGET(0x79)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x7a:
+        TARGET(0x7a)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x7b:
+        TARGET(0x7b)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x7c:
+        TARGET(0x7c)
         {
-            op = opcodes[ip++];
-            if (flags[SF] != flags[OF])
-                ip += (char)op;
-            break;
+            if (GetFlag(SF) != GetFlag(OF))
+                ip += instr->imm;
+            DISPATCH();
         }
-        case 0x7d:
+        TARGET(0x7d)
         {
-            op = opcodes[ip++];
-            if (flags[SF] == flags[OF])
-                ip += (char)op;
-            break;
+            if (GetFlag(SF) == GetFlag(OF))
+                ip += instr->imm;
+            DISPATCH();
         }
-        case 0x7e:
+        TARGET(0x7e)
         {
-            op = opcodes[ip++];
-            if (flags[ZF] || flags[SF] != flags[OF])
-                ip += (char)op;
-            break;
+            if (GetFlag(ZF) || GetFlag(SF) != GetFlag(OF))
+                ip += instr->imm;
+            DISPATCH();
         }
-        case 0x7f:
+        TARGET(0x7f)
         {
-            op = opcodes[ip++];
-            if (!flags[ZF] && flags[SF] == flags[OF])
-                ip += (char)op;
-            break;
+            if (!GetFlag(ZF) && GetFlag(SF) == GetFlag(OF))
+                ip += instr->imm;
+            DISPATCH();
         }
-        case 0x80:
+        TARGET(0x80)
         {
-            op = opcodes[ip++];
-            switch (GetRegister(op))
-            {
-            case CMP:
-            {
-                UpdateFlags8(GetModMemVal8(op, true), opcodes[ip++], SUBTRACTION);
-                break;
-            }
-            default:
-                printf("Not Yet Implemented 0x80: %2x\n", op);
-                break;
-            }
-            break;
+            AluGroup<unsigned char>(instr);
+            DISPATCH();
         }
-        case 0x81:
+        TARGET(0x81)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluGroup<unsigned short>(instr);
+            DISPATCH();
         }
-        case 0x82:
+        TARGET(0x82)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluGroup<unsigned char>(instr);
+            DISPATCH();
         }
-        case 0x83:
+        TARGET(0x83)
         {
-            op = opcodes[ip++];
-
-            switch (GetRegister(op))
-            {
-            case AND:
-            {
-                short val = GetModMemVal(op, true) & opcodes[ip++];
-                SetModMemVal(val, op, true);
-                break;
-            }
-            default:
-
-                printf("Not Yet Implemented: %d\n", op);
-                break;
-            }
-
-            break;
+            AluGroup<unsigned short>(instr);
+            DISPATCH();
         }
-        case 0x84:
+        TARGET(0x84)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned char, TEST, false>(instr);
+            DISPATCH();
         }
-        case 0x85:
+        TARGET(0x85)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluModRM<unsigned short, TEST, false>(instr);
+            DISPATCH();
         }
-        case 0x86:
+        TARGET(0x86)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x87:
+        TARGET(0x87)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x88:
+        TARGET(0x88)
         {
-            op = opcodes[ip++];
-            SetModMemVal8(registers[GetRegister(op) % 4][GetRegister(op) <= 3], op, true);
-            break;
+            *ResolveOperand<unsigned char, true>(instr) = ByteRegister(instr->reg);
+            DISPATCH();
         }
-        case 0x89:
+        TARGET(0x89)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x8a:
+        TARGET(0x8a)
         {
-            op = opcodes[ip++];
-
-            registers[GetRegister(op) % 4][GetRegister(op) <= 3] = GetModMemVal8(op, true);
+            ByteRegister(instr->reg) = *ResolveOperand<unsigned char>(instr);
 
-            break;
+            DISPATCH();
         }
-        case 0x8b:
+        TARGET(0x8b)
         {
-            op = opcodes[ip++];
-
-            short val = GetModMemVal(op, true);
+            short val = *ResolveOperand<unsigned short>(instr);
 
-            registers[GetRegister(op)][1] = val & 0xFF;
-            registers[GetRegister(op)][0] = (val >> 8) & 0xFF;
+            registers[instr->reg].word = val;
 
-            break;
+            DISPATCH();
         }
-        case 0x8c:
+        TARGET(0x8c)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x8d:
+        TARGET(0x8d)
         {
-            op = opcodes[ip++];
-            short val = (opcodes[ip++] & 0xFF) + ((opcodes[ip++] & 0xFF) << 8);
-
-            registers[GetRegister(op)][1] = val & 0xFF;
-            registers[GetRegister(op)][0] = (val >> 8) & 0xFF;
-            break;
+            registers[instr->reg].word = GetEffectiveAddress(instr);
+            DISPATCH();
         }
-        case 0x8e:
+        TARGET(0x8e)
         {
-            op = opcodes[ip++];
+            short val = *ResolveOperand<unsigned short>(instr);
+            SetSegment(instr->reg & 0x3, val);
 
-            short val = GetModMemVal(op, true);
-            special_registers[GetRegister(op)][1] = val & 0xFF;
-            special_registers[GetRegister(op)][0] = (val >> 8) & 0xFF;
-
-            break;
+            DISPATCH();
         }
-        case 0x8f:
+        TARGET(0x8f)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x90:
+        TARGET(0x90)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x91:
+        TARGET(0x91)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x92:
+        TARGET(0x92)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x93:
+        TARGET(0x93)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x94:
+        TARGET(0x94)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x95:
+        TARGET(0x95)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x96:
+        TARGET(0x96)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x97:
+        TARGET(0x97)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x98:
+        TARGET(0x98)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x99:
+        TARGET(0x99)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x9a:
+        TARGET(0x9a)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            Push(special_registers[CS].word);
+            Push(ip);
+            ip = (unsigned short)instr->imm;
+            SetSegment(CS, instr->imm2);
+            DISPATCH();
         }
-        case 0x9b:
+        TARGET(0x9b)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x9c:
+        TARGET(0x9c)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            Push(GetFlagsWord());
+            DISPATCH();
         }
-        case 0x9d:
+        TARGET(0x9d)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            SetFlagsWord(Pop());
+            DISPATCH();
         }
-        case 0x9e:
+        TARGET(0x9e)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0x9f:
+        TARGET(0x9f)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xa0:
+        TARGET(0xa0)
         {
-            short offset = opcodes[ip++] + (opcodes[ip++] << 8);
+            unsigned short offset = instr->imm;
 
-            registers[AX][AL] = GetDataStart()[offset];
-            break;
+            registers[AX].byte[AL] = GetDataStart()[offset];
+            DISPATCH();
         }
-        case 0xa1:
+        TARGET(0xa1)
         {
-            short offset = opcodes[ip++] + (opcodes[ip++] << 8);
+            unsigned short offset = instr->imm;
 
-            registers[AX][AH] = GetDataStart()[offset + 1];
-            registers[AX][AL] = GetDataStart()[offset];
-            break;
+            registers[AX].byte[AH] = GetDataStart()[offset + 1];
+            registers[AX].byte[AL] = GetDataStart()[offset];
+            DISPATCH();
         }
-        case 0xa2:
+        TARGET(0xa2)
         {
-            short val = opcodes[ip++] + (opcodes[ip++] << 8);
-            GetDataStart()[val] = registers[AX][AL];
-            break;
+            unsigned short offset = instr->imm;
+
+            *StoreAddress(GetDataStart() + offset, 1) = registers[AX].byte[AL];
+            DISPATCH();
         }
-        case 0xa3:
+        TARGET(0xa3)
         {
-            short offset = opcodes[ip++] + (opcodes[ip++] << 8);
+            unsigned short offset = instr->imm;
 
-            GetDataStart()[offset + 1] = registers[AX][AH];
-            GetDataStart()[offset] = registers[AX][AL];
-            break;
+            unsigned char *target = StoreAddress(GetDataStart() + offset, 2);
+
+            target[1] = registers[AX].byte[AH];
+            target[0] = registers[AX].byte[AL];
+            DISPATCH();
         }
-        case 0xa4:
+        TARGET(0xa4)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned char>(instr->op);
+            DISPATCH();
         }
-        case 0xa5:
+        TARGET(0xa5)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned short>(instr->op);
+            DISPATCH();
         }
-        case 0xa6:
+        TARGET(0xa6)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned char>(instr->op);
+            DISPATCH();
         }
-        case 0xa7:
+        TARGET(0xa7)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned short>(instr->op);
+            DISPATCH();
         }
-        case 0xa8:
+        TARGET(0xa8)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned char, TEST>(instr);
+            DISPATCH();
         }
-        case 0xa9:
+        TARGET(0xa9)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            AluAccumulator<unsigned short, TEST>(instr);
+            DISPATCH();
         }
-        case 0xaa:
+        TARGET(0xaa)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned char>(instr->op);
+            DISPATCH();
         }
-        case 0xab:
+        TARGET(0xab)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned short>(instr->op);
+            DISPATCH();
         }
-        case 0xac:
+        TARGET(0xac)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned char>(instr->op);
+            DISPATCH();
         }
-        case 0xad:
+        TARGET(0xad)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned short>(instr->op);
+            DISPATCH();
         }
-        case 0xae:
+        TARGET(0xae)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned char>(instr->op);
+            DISPATCH();
         }
-        case 0xaf:
+        TARGET(0xaf)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            StringStep<unsigned short>(instr->op);
+            DISPATCH();
         }
-        case 0xb0:
-        case 0xb1:
-        case 0xb2:
-        case 0xb3:
-        case 0xb4:
-        case 0xb5:
-        case 0xb6:
-        case 0xb7:
-        {
-            short reg = (op & 0xF);
-            registers[reg % 4][reg <= 3] = opcodes[ip++];
-            break;
+        TARGET(0xb0)
+        TARGET(0xb1)
+        TARGET(0xb2)
+        TARGET(0xb3)
+        TARGET(0xb4)
+        TARGET(0xb5)
+        TARGET(0xb6)
+        TARGET(0xb7)
+        {
+            short reg = instr->reg;
+            ByteRegister(reg) = instr->imm;
+            DISPATCH();
         }
-        case 0xb8:
-        case 0xb9:
-        case 0xba:
-        case 0xbb:
-        case 0xbc:
-        case 0xbd:
-        case 0xbe:
-        case 0xbf:
-        {
-            short reg = (op & 0xF) - 0x8;
-            registers[reg][1] = opcodes[ip++];
-            registers[reg][0] = opcodes[ip++];
-            break;
+        TARGET(0xb8)
+        TARGET(0xb9)
+        TARGET(0xba)
+        TARGET(0xbb)
+        TARGET(0xbc)
+        TARGET(0xbd)
+        TARGET(0xbe)
+        TARGET(0xbf)
+        {
+            short reg = instr->reg;
+            registers[reg].word = instr->imm;
+            DISPATCH();
         }
-        case 0xc0:
+        TARGET(0xc0)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xc1:
+        TARGET(0xc1)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xc2:
+        TARGET(0xc2)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            ip = (unsigned short)Pop();
+            registers[SP].word += instr->imm;
+            PopReturnPrediction();
+            DISPATCH();
         }
-        case 0xc3:
+        TARGET(0xc3)
         {
-            ip = call_stack[--csp];
-            break;
+            ip = (unsigned short)Pop();
+            PopReturnPrediction();
+            DISPATCH();
         }
-        case 0xc4:
+        TARGET(0xc4)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xc5:
+        TARGET(0xc5)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xc6:
+        TARGET(0xc6)
         {
-            op = opcodes[ip++];
-            SetModMemVal8(NULL, op, true);
-            break;
+            *ResolveOperand<unsigned char, true>(instr) = instr->imm;
+            DISPATCH();
         }
-        case 0xc7:
+        TARGET(0xc7)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xc8:
+        TARGET(0xc8)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xc9:
+        TARGET(0xc9)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xca:
+        TARGET(0xca)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            ip = (unsigned short)Pop();
+            SetSegment(CS, Pop());
+            registers[SP].word += instr->imm;
+            DISPATCH();
         }
-        case 0xcb:
+        TARGET(0xcb)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            ip = (unsigned short)Pop();
+            SetSegment(CS, Pop());
+            DISPATCH();
         }
-        case 0xcc:
+        TARGET(0xcc)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xcd:
+        TARGET(0xcd)
         {
-            char val = opcodes[ip++];
+            char val = instr->imm;
             PerformInterrupt(val);
-            break;
+            DISPATCH();
         }
-        case 0xce:
+        TARGET(0xce)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xcf:
+        TARGET(0xcf)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd0:
+        TARGET(0xd0)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd1:
+        TARGET(0xd1)
         {
-            op = opcodes[ip++];
-
-            switch (GetRegister(op))
+            switch (instr->reg)
             {
             case SHR:
             {
-                short val = GetModMemVal(op, true) >> 1;
-                SetModMemVal(val, op, true);
+                unsigned short *operand = ResolveOperand<unsigned short, true>(instr);
+                unsigned short val = *operand;
+                *operand = val >> 1;
+                UpdateFlags<unsigned short>(val, 1, val >> 1, SHIFT_RIGHT);
+                break;
             }
             }
 
-            break;
+            DISPATCH();
         }
-        case 0xd2:
+        TARGET(0xd2)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd3:
+        TARGET(0xd3)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd4:
+        TARGET(0xd4)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd5:
+        TARGET(0xd5)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd6:
+        TARGET(0xd6)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd7:
+        TARGET(0xd7)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd8:
+        TARGET(0xd8)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xd9:
+        TARGET(0xd9)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xda:
+        TARGET(0xda)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xdb:
+        TARGET(0xdb)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xdc:
+        TARGET(0xdc)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xdd:
+        TARGET(0xdd)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xde:
+        TARGET(0xde)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xdf:
+        TARGET(0xdf)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xe0:
+        TARGET(0xe0)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xe1:
+        TARGET(0xe1)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xe2:
+        TARGET(0xe2)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xe3:
+        TARGET(0xe3)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xe4:
+        TARGET(0xe4)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xe5:
+        TARGET(0xe5)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xe6:
+        TARGET(0xe6)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            WritePort((unsigned char)instr->imm, registers[AX].byte[AL]);
+            DISPATCH();
         }
-        case 0xe7:
+        TARGET(0xe7)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            WritePort((unsigned char)instr->imm, registers[AX].byte[AL]);
+            WritePort((unsigned char)instr->imm + 1, registers[AX].byte[AH]);
+            DISPATCH();
         }
-        case 0xe8:
+        TARGET(0xe8)
         {
-            short rel = opcodes[ip++] + (opcodes[ip++] << 8);
-            call_stack[csp++] = ip;
+            short rel = instr->imm;
+            Push(ip);
+            PushReturnPrediction(ip);
             ip += rel;
-            break;
+            DISPATCH();
         }
-        case 0xe9:
+        TARGET(0xe9)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xea:
+        TARGET(0xea)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            ip = (unsigned short)instr->imm;
+            SetSegment(CS, instr->imm2);
+            DISPATCH();
         }
-        case 0xeb:
+        TARGET(0xeb)
         {
-            op = opcodes[ip++];
-            ip += (char)op;
-            break;
+            ip += instr->imm;
+            DISPATCH();
         }
-        case 0xec:
+        TARGET(0xec)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xed:
+        TARGET(0xed)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xee:
+        TARGET(0xee)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            WritePort(registers[DX].word, registers[AX].byte[AL]);
+            DISPATCH();
         }
-        case 0xef:
+        TARGET(0xef)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            WritePort(registers[DX].word, registers[AX].byte[AL]);
+            WritePort(registers[DX].word + 1, registers[AX].byte[AH]);
+            DISPATCH();
         }
-        case 0xf0:
+        TARGET(0xf0)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xf1:
+        TARGET(0xf1)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xf2:
+        TARGET(0xf2)
+        TARGET(0xf3)
         {
-            op = opcodes[ip++];
-            switch (op)
-            {
-            case SCASB:
-            {
-                unsigned char *start = GetDataStart(ES) + (registers[DI][0] << 8) + registers[DI][1];
-
-                flags[ZF] = false;
+            unsigned char op = instr->imm;
 
-                while (*start != '$')
-                {
-                    if (*start == registers[AX][AL])
-                    {
-                        flags[ZF] = true;
-                        break;
-                    }
-                    start++;
-                }
-                break;
+            if (op >= MOVSB && op <= SCASB + 1 && op != 0xa8 && op != 0xa9)
+            {
+                if (op & 0x1)
+                    RepeatString<unsigned short>(op, instr->op);
+                else
+                    RepeatString<unsigned char>(op, instr->op);
             }
-            default:
-                printf("0xf2 component not implemented");
-                break;
+            else
+            {
+                printf("Not Yet Implemented: %2x %2x\n", instr->op, op);
             }
-            break;
-        }
-        case 0xf3:
-        {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            DISPATCH();
         }
-        case 0xf4:
+        TARGET(0xf4)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xf5:
+        TARGET(0xf5)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xf6:
+        TARGET(0xf6)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xf7:
+        TARGET(0xf7)
         {
-            op = opcodes[ip++];
-
-            switch (GetRegister(op))
+            switch (instr->reg)
             {
             case NEG:
             {
-                SetModMemVal(~GetModMemVal(op, false), op, true);
+                unsigned short *operand = ResolveOperand<unsigned short, true>(instr);
+                *operand = Alu<unsigned short, SUB>(0, *operand);
                 break;
             }
             default:
-                printf("Not Yet Implemented f7: %2x\n", op);
+                printf("Not Yet Implemented f7: %2x\n", instr->reg);
                 break;
             }
-            break;
+            DISPATCH();
         }
-        case 0xf8:
+        TARGET(0xf8)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xf9:
+        TARGET(0xf9)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xfa:
+        TARGET(0xfa)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xfb:
+        TARGET(0xfb)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        case 0xfc:
+        TARGET(0xfc)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            SetFlag(DF, false);
+            DISPATCH();
         }
-        case 0xfd:
+        TARGET(0xfd)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            SetFlag(DF, true);
+            DISPATCH();
         }
-        case 0xfe:
+        TARGET(0xfe)
         {
-            op = opcodes[ip++];
-
-            if (GetRegister(op) == INC)
+            if (instr->reg == INC)
             {
-                char val = GetModMemVal8(op, false) + 1;
-                SetModMemVal8(val, op, true);
+                unsigned char *operand = ResolveOperand<unsigned char, true>(instr);
+                *operand = IncDec<unsigned char, INC>(*operand);
             }
-            else if (GetRegister(op) == DEC)
+            else if (instr->reg == DEC)
             {
-                SetModMemVal8(GetModMemVal8(op, false) - 1, op, true);
+                unsigned char *operand = ResolveOperand<unsigned char, true>(instr);
+                *operand = IncDec<unsigned char, DEC>(*operand);
             }
 
-
-            break;
+            DISPATCH();
         }
-        case 0xff:
+        TARGET(0xff)
         {
-            printf("Not Yet Implemented: %2x\n", op);
-            break;
+            printf("Not Yet Implemented: %2x\n", instr->op);
+            DISPATCH();
         }
-        default:
-            run = false;
-            break;
         }
 
         instr_executed++;
 
-        if (instr_executed == step)
+        if (Debug && instr_executed == step)
             debug = true;
-
-        op = opcodes[ip++];
     }
 }
 
-// Start the emulation
+#undef TARGET
+#undef DISPATCH
+
+// Loads the program and gets it ready to run, RunFor then runs it
 void DOSEmulator::StartEmulation()
 {
-    send_ping_async("start");
+    HostCommand(HOST_START, NULL, 0);
 
     header = (DOS_HEADER *)data;
 
@@ -3157,11 +2896,31 @@ void DOSEmulator::StartEmulation()
 
     PrintHeader(header);
 
-    startAddress = CalculateStartAddress();
+    LoadImage();
+
+    startAddress = (LOAD_SEGMENT + GetEntrySegment()) * 16;
 
     fprintf(stdout, "Runtime: %04x\n", startAddress);
 
-    RunCode();
+    // The program starts on a blank text screen, the first frame draws all of it
+    video_mode = false;
+    SetDefaultPalette();
+    ClearText();
+
+    instr_executed = 0;
+    run = true;
+
+    ClearFlags();
+
+    SetRegistersFromHeader();
+
+    ClearDecodeCache();
+
+#ifdef JIT_SUPPORTED
+    if (jit_enabled)
+        ResetJit();
 
-    free(data);
+    // The entry point starts the first block
+    jit_block_head = true;
+#endif
 }
\ No newline at end of file
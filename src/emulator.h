@@ -1,5 +1,8 @@
+#pragma once
+
 #include "./structs.h"
 #include <vector>
+#include <stdlib.h>
 #include "bridge.h"
 
 #define AX 0
@@ -11,14 +14,26 @@
 #define SI 6
 #define DI 7
 
-#define AH 0
-#define AL 1
-#define CH 0
-#define CL 1
-#define DH 0
-#define DL 1
-#define BH 0
-#define BL 1
+// Marks an unused base or index register in the Mod R/M table
+#define NO_REGISTER 0xFF
+
+// Index of the halves of a register word on this host
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HIGH_BYTE 0
+#define LOW_BYTE 1
+#else
+#define HIGH_BYTE 1
+#define LOW_BYTE 0
+#endif
+
+#define AH HIGH_BYTE
+#define AL LOW_BYTE
+#define CH HIGH_BYTE
+#define CL LOW_BYTE
+#define DH HIGH_BYTE
+#define DL LOW_BYTE
+#define BH HIGH_BYTE
+#define BL LOW_BYTE
 
 #define ES 0
 #define CS 1
@@ -38,19 +53,52 @@
 
 #define SHR 5
 
+// ALU operations, numbered like the reg field of the immediate group opcodes
+#define ADD 0
+#define OR 1
+#define ADC 2
+#define SBB 3
 #define AND 4
+#define SUB 5
+#define XOR 6
 #define CMP 7
+#define TEST 8
 
+// String instructions, by their byte forms
+#define MOVSB 0xa4
+#define CMPSB 0xa6
+#define STOSB 0xaa
+#define LODSB 0xac
 #define SCASB 0xae
 
+#define REPNE 0xf2
+#define REPE 0xf3
+
+// Reasons RunFor hands control back to the host
+#define STOP_BUDGET 0     // Ran the instructions it was given
+#define STOP_INPUT 1      // The program waits for a key, push one with PushKey
+#define STOP_FRAME 2      // Ran the instructions it was given and the display changed
+#define STOP_EXIT 3       // The program ended
+#define STOP_BREAKPOINT 4 // Stopped in the debugger, send commands with DebugCommand
+
+// Bytes of commands for the host that are queued before they have to be handed over, must be a power of two
+#define COMMAND_RING_SIZE 0x10000u
+
+// Keys pushed by the host that the program hasn't read yet, must be a power of two
+#define KEY_QUEUE_SIZE 16
+
 #define NEG 3
 
 #define INC 0
 #define DEC 1
 
+// Lazy flags operations. INC and DEC add or subtract 1 but keep CF, a right shift keeps what it shifted out
 #define ADDITION 0
 #define SUBTRACTION 1
-#define XOR 2
+#define LOGIC 2
+#define INCREMENT 3
+#define DECREMENT 4
+#define SHIFT_RIGHT 5
 
 #define WRITE_CHAR_STDOUT 0x2
 #define READ_CHAR_STDIN_NOECHO 0x8
@@ -58,6 +106,102 @@
 #define GET_SYSTEM_TIME 0x2C
 #define EXIT_PROGRAM 0x4C
 
+#define FORMAT_NONE 0x0
+#define FORMAT_MODRM 0x1
+#define FORMAT_IMM8 0x2
+#define FORMAT_IMM16 0x4
+#define FORMAT_FAR 0x8
+#define FORMAT_PREFIX 0x10
+#define FORMAT_GROUP3 0x20
+
+// Real mode guest memory. Segment:offset pairs reach up to 0x10FFEF, the extra 64K keeps them inside the arena
+#define MEMORY_SIZE 0x100000
+#define MEMORY_SLACK 0x10000
+
+// On Linux guest memory is mapped between guard regions and the extra 64K mirrors the start of memory
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define GUARDED_MEMORY
+#include <signal.h>
+#endif
+
+// Bytes of PROT_NONE address space on each side of guest memory
+#define MEMORY_GUARD_SIZE 0x100000
+// Paragraph the MZ image is loaded at, the PSP takes the 16 paragraphs below it like under DOS
+#define LOAD_SEGMENT 0x1000
+#define PSP_SEGMENT (LOAD_SEGMENT - 0x10)
+
+// Guest memory is described in 4 KiB pages, stores to a page that isn't plain RAM leave the fast path
+#define MEMORY_PAGE_SHIFT 12
+#define MEMORY_PAGE_COUNT (MEMORY_SIZE >> MEMORY_PAGE_SHIFT)
+
+// Page types, a page can be more than one
+#define PAGE_RAM 0x0
+#define PAGE_ROM 0x1   // Stores are dropped
+#define PAGE_VIDEO 0x2 // Stores mark the display dirty
+#define PAGE_CODE 0x4  // Instructions were decoded from it, stores bump the write generations
+#define PAGE_WATCH 0x8 // Holds a watchpoint, stores check the watchpoint map
+
+// Regions of the real mode memory map
+#define VGA_MEMORY_START 0xA0000
+#define VGA_MEMORY_END 0xB0000
+// Mode 13h is 320x200 with a byte per pixel, starting at A000:0000
+#define VGA_WIDTH 320
+#define VGA_HEIGHT 200
+// The host gets the display as RGBA pixels, every mode 13h pixel doubled both ways
+#define FRAME_WIDTH (VGA_WIDTH * 2)
+#define FRAME_HEIGHT (VGA_HEIGHT * 2)
+// DAC ports, the index of the palette entry to write and its red, green and blue one after the other
+#define DAC_WRITE_INDEX 0x3C8
+#define DAC_DATA 0x3C9
+#define TEXT_MEMORY_START 0xB8000
+#define TEXT_MEMORY_END 0xC0000
+// Text mode is 80x25 cells of a character byte and an attribute byte, starting at B800:0000
+#define TEXT_COLUMNS 80
+#define TEXT_ROWS 25
+// Attribute of a blank cell, light gray on black
+#define TEXT_ATTRIBUTE 0x07
+// Cells are drawn 8x16 from the 8x8 ROM font with every row doubled, 80x25 of them fill the 640x400 output
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+// Glyphs of the ROM font are 8x8, mode 13h shows 40x25 characters of them
+#define ROM_GLYPH_HEIGHT 8
+#define GRAPHICS_COLUMNS (VGA_WIDTH / GLYPH_WIDTH)
+#define GRAPHICS_ROWS (VGA_HEIGHT / ROM_GLYPH_HEIGHT)
+// Number of drawn cells the glyph cache keeps, must be a power of two
+#define GLYPH_CACHE_SIZE 256
+#define BIOS_ROM_START 0xF0000
+
+// Bytes of a map with one bit per linear address, for breakpoints, watchpoints and decoded instruction bytes
+#define ADDRESS_MAP_SIZE ((MEMORY_SIZE + MEMORY_SLACK) / 8)
+
+// Number of slots in the decode cache, must be a power of two
+#define DECODE_CACHE_SIZE 4096
+
+// Stores over decoded instruction bytes are tracked per 256 byte page of guest memory so cached code from a written page is dropped
+#define CODE_PAGE_SHIFT 8
+// Number of tracked pages covering 1 MiB, must be a power of two, addresses past the end wrap around like memory
+#define CODE_PAGE_COUNT 4096
+
+// The JIT emits x86-64 code, everywhere else (including the browser build) only the interpreter runs
+#if defined(__x86_64__) && defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define JIT_SUPPORTED
+#endif
+
+// Times the interpreter has to enter a block before it is compiled
+#define JIT_DEFAULT_THRESHOLD 50
+// Number of slots in the JIT block table, must be a power of two
+#define JIT_BLOCK_TABLE_SIZE 4096
+// Bytes of executable memory for generated code, all blocks are dropped when it fills up
+#define JIT_BUFFER_SIZE (1 << 20)
+// Most blocks one call into compiled code runs through links before returning to the run loop
+#define JIT_CHAIN_LIMIT 4096
+// Most guest instructions compiled into one block
+#define JIT_MAX_BLOCK_INSTRS 64
+// Number of CALLs the return predictions remember, must be a power of two
+#define RETURN_STACK_SIZE 16
+// Upper bound of the host code emitted for one guest instruction
+#define JIT_MAX_INSTR_BYTES 384
+
 class Cursor 
 {
     public:
@@ -76,28 +220,106 @@ public:
         vCursor = new Cursor;
     }
 
+    ~DOSEmulator()
+    {
+        FreeMemory();
+#ifdef JIT_SUPPORTED
+        FreeJit();
+#endif
+        free(data);
+        delete vCursor;
+    }
+
     void StartEmulation();
+    int RunFor(long long budget);
+    bool DebugCommand(char *line);
+    void PushKey(char key);
+    void SetHeldKey(char key);
+    long long GetInstructionsExecuted();
+    void PresentFrame();
+    FRAME_STATS GetFrameStats();
+    void EnableJit(bool enable);
+    void SetJitThreshold(int threshold);
+    TIER_STATS GetTierStats();
 private:
     unsigned char * data;
+    unsigned char * memory = NULL;
+    unsigned char * segment_bases[6];
     int startAddress;
     DOS_HEADER *header;
-    unsigned char registers[8][2];
-    unsigned char special_registers[6][2];
-    int call_stack[256];
-    int csp = 0;
+    REGISTER registers[8];
+    REGISTER special_registers[6];
     bool flags[8];
+    LAZY_FLAGS lazy_flags;
     unsigned char * opcodes;
     int ip = 0;
+    int instr_ip = 0;
     long long instr_executed = 0;
-    int step = 0;
+    long long step = 0;
+    long long stop_at = 0;
+    int stop_reason = STOP_BUDGET;
     bool run = true;
     bool debug;
+    bool debug_resume = false;
+    char key_queue[KEY_QUEUE_SIZE];
+    unsigned int key_head = 0;
+    unsigned int key_tail = 0;
+    char held_key = 0;
+    unsigned char command_ring[COMMAND_RING_SIZE];
+    unsigned int command_head = 0;
+    unsigned int command_tail = 0;
+    unsigned int write_start = 0;
+    int write_len = 0;
+    bool write_open = false;
     Cursor * vCursor;
     bool video_mode = false;
-    std::vector<int> breakpoints;
+    unsigned char breakpoint_map[ADDRESS_MAP_SIZE] = {};
+    unsigned char watchpoint_map[ADDRESS_MAP_SIZE] = {};
+    int breakpoint_count = 0;
+    int watchpoint_count = 0;
+    DECODED_INSTR decode_cache[DECODE_CACHE_SIZE];
+    unsigned int page_generation[CODE_PAGE_COUNT] = {};
+    unsigned char page_types[MEMORY_PAGE_COUNT] = {};
+    unsigned char decoded_map[ADDRESS_MAP_SIZE] = {};
+    unsigned char rom_sink[2];
+    bool video_dirty = false;
+    unsigned long long dirty_lines[(VGA_HEIGHT + 63) / 64] = {};
+    unsigned int palette[256] = {};
+    unsigned char dac_index = 0;
+    unsigned char dac_rgb[3];
+    int dac_component = 0;
+    unsigned int frame_rgba[FRAME_WIDTH * FRAME_HEIGHT];
+    unsigned int text_dirty_rows = 0;
+    unsigned int text_shadow[TEXT_COLUMNS * TEXT_ROWS];
+    unsigned int glyph_keys[GLYPH_CACHE_SIZE];
+    unsigned int glyph_tiles[GLYPH_CACHE_SIZE][GLYPH_WIDTH * GLYPH_HEIGHT];
+    FRAME_STATS frame_stats = {};
+    bool jit_enabled = false;
+    int jit_threshold = JIT_DEFAULT_THRESHOLD;
+    TIER_STATS tier_stats = {};
+#ifdef JIT_SUPPORTED
+    unsigned char *jit_buffer = NULL;
+    int jit_used = 0;
+    JIT_BLOCK *jit_blocks = NULL;
+    std::vector<JIT_EXIT> jit_exits;
+    int jit_fuel = 0;
+    bool jit_block_head = true;
+    bool jit_code_written = false;
+    RETURN_PREDICTION return_stack[RETURN_STACK_SIZE];
+    unsigned int return_top = 0;
+#endif
 
-    void RunCode();
-    int CalculateStartAddress();
+    template <bool Debug>
+    void RunLoop();
+    bool DebugArmed();
+    int GetEntrySegment();
+    void AllocateMemory();
+    void FreeMemory();
+#ifdef GUARDED_MEMORY
+    static void HandleMemoryFault(int signal, siginfo_t *info, void *);
+#endif
+    void LoadImage();
+    void SetSegment(unsigned char reg, unsigned short val);
     void PrintStack();
     void ClearRegisters();
     void ClearFlags();
@@ -105,36 +327,106 @@ private:
     short GetRegister(char op);
     short GetModRegister(char op);
     char GetModValue(char op);
+    unsigned char &ByteRegister(unsigned char reg);
+    template <typename T>
+    T *RegisterOperand(unsigned char reg);
     unsigned char * GetDataStart(short reg);
-    short GetModMemVal(char op, bool commit_changes);
-    void SetModMemVal(short val, char op, bool commit_changes);
-    char GetModMemVal8(char op, bool commit_changes);
-    void SetModMemVal8(char val, char op, bool commit_changes);
+    unsigned short GetEffectiveAddress(DECODED_INSTR *instr);
+    template <typename T, bool Write = false>
+    T *ResolveOperand(DECODED_INSTR *instr);
+    void MarkWritten(int address, int size);
+    void SetPageTypes(int start, int end, unsigned char type);
+    unsigned char *StoreAddress(unsigned char *address, int size);
+    unsigned char *SpecialStore(unsigned char *address, int size);
     void PerformInterrupt(char val);
-    bool CheckIfCarry(unsigned short val1, unsigned short val2, char operation);
-    bool CheckIfParity(unsigned short val1, unsigned short val2, char operation);
-    bool CheckIfAuxiliary(unsigned short val1, unsigned short val2, char operation);
-    bool CheckIfZero(unsigned short val1, unsigned short val2, char operation);
-    bool CheckIfSign(unsigned short val1, unsigned short val2, char operation);
-    bool CheckIfInterrupt(unsigned short val1, unsigned short val2, char operation);
-    bool CheckIfDirection(unsigned short val1, unsigned short val2, char operation);
-    bool CheckIfOverflow(unsigned short val1, unsigned short val2, char operation);
-    void UpdateFlags(unsigned short val1, unsigned short val2, char operation);
-    bool CheckIfCarry8(unsigned char val1, unsigned char val2, char operation);
-    bool CheckIfParity8(unsigned char val1, unsigned char val2, char operation);
-    bool CheckIfAuxiliary8(unsigned char val1, unsigned char val2, char operation);
-    bool CheckIfZero8(unsigned char val1, unsigned char val2, char operation);
-    bool CheckIfSign8(unsigned char val1, unsigned char val2, char operation);
-    bool CheckIfInterrupt8(unsigned char val1, unsigned char val2, char operation);
-    bool CheckIfDirection8(unsigned char val1, unsigned char val2, char operation);
-    bool CheckIfOverflow8(unsigned char val1, unsigned char val2, char operation);
-    void UpdateFlags8(unsigned char val1, unsigned char val2, char operation);
+    bool ReadKey(unsigned char *key);
+    void StopRun(int reason);
+    void MarkScanlines(int linear, int size);
+    void SetDacColor(int index, unsigned char red, unsigned char green, unsigned char blue);
+    void SetDefaultPalette();
+    void WritePort(unsigned short port, unsigned char val);
+    void ConvertScanlines(int first, int count);
+    int PresentScanlines();
+    void ClearText();
+    void ScrollScreen();
+    void PutCharacter(unsigned char character, int attribute, int column, int row);
+    void TeletypeCharacter(unsigned char character, int attribute);
+    void WriteTeletype(const unsigned char *text, int len);
+    void InvalidateText();
+    const unsigned int *GlyphTile(unsigned int cell);
+    bool DrawTextRow(int row);
+    int PresentText();
+    void ReserveCommands(int size);
+    void HostCommand(unsigned char command, const unsigned char *payload, int size,
+                     const unsigned char *extra = NULL, int extra_size = 0);
+    void HostWrite(const unsigned char *text, int len);
+    void FlushCommands();
+    template <typename T>
+    void UpdateFlags(T val1, T val2, unsigned int result, char operation);
+    template <typename T, int Operation>
+    T Alu(T val1, T val2);
+    template <typename T, int Operation>
+    T IncDec(T val);
+    template <typename T, int Operation, bool ToRegister>
+    void AluModRM(DECODED_INSTR *instr);
+    template <typename T, int Operation>
+    void AluAccumulator(DECODED_INSTR *instr);
+    template <typename T>
+    void AluGroup(DECODED_INSTR *instr);
+    template <typename T>
+    void StringStep(unsigned char op);
+    template <typename T>
+    int StringBulk(unsigned char op, unsigned char prefix, int count, bool down);
+    template <typename T>
+    void RepeatString(unsigned char op, unsigned char prefix);
+    unsigned char *StoreRange(unsigned char *address, int size);
+    bool CheckIfCarry();
+    bool CheckIfParity();
+    bool CheckIfAuxiliary();
+    bool CheckIfZero();
+    bool CheckIfSign();
+    bool CheckIfOverflow();
+    bool GetFlag(unsigned char flag);
+    void SetFlag(unsigned char flag, bool val);
+    void ResolveFlags();
+    short GetFlagsWord();
+    void SetFlagsWord(short val);
     void Push(short val);
-    void Push8(char val);
     short Pop();
-    char Pop8();
-    void DebugMenu();
-    bool CheckIfBreakpoint(char op);
+    bool CheckIfBreakpoint();
+    bool CheckIfWatched(int address, int size);
+    void ClearDecodeCache();
+    void DecodeInstruction(int address, DECODED_INSTR *instr);
+    DECODED_INSTR *FetchInstruction();
+    void PrintTierStats();
+    void PushReturnPrediction(int return_ip);
+    void PopReturnPrediction();
+#ifdef JIT_SUPPORTED
+    void ClearReturnPredictions();
+    void ResetJit();
+    void FreeJit();
+    bool RunJitBlock();
+    static bool EndsJitBlock(DECODED_INSTR *instr);
+    void LinkExits();
+    void UnlinkBlocks(int address);
+    unsigned int BlockGeneration(int address, int length);
+    static unsigned char *JitSpecialStore(DOSEmulator *emulator, unsigned char *address, int size);
+    static void JitResolveFlags(DOSEmulator *emulator);
+    void EmitExit(unsigned char *&code, int ip);
+    void EmitStoreCheck(unsigned char *&code, char width);
+    void EmitCodeWrittenCheck(unsigned char *&code, int next_ip, int skipped);
+    void CompileBlock(int address, JIT_BLOCK *block);
+    int StateOffset(void *field);
+    int RegisterOffset(unsigned char reg, char width);
+    void EmitOperandAddress(unsigned char *&code, DECODED_INSTR *instr, bool write);
+    void EmitLoadOperand(unsigned char *&code, char host_reg, DECODED_INSTR *instr);
+    void EmitStoreOperand(unsigned char *&code, char host_reg, DECODED_INSTR *instr);
+    void EmitAlu(unsigned char *&code, DECODED_INSTR *instr, bool record_flags);
+    void EmitMove(unsigned char *&code, DECODED_INSTR *instr);
+    void EmitIncDec(unsigned char *&code, DECODED_INSTR *instr, bool record_flags, DECODED_INSTR *carry_instr);
+    void EmitSaveCarry(unsigned char *&code, DECODED_INSTR *carry_instr);
+    void EmitBranch(unsigned char *&code, DECODED_INSTR *instr, int next_ip, DECODED_INSTR *flags_instr);
+#endif
 };
 
     
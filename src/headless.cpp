@@ -0,0 +1,160 @@
+#include "./emulator.h"
+#include "bridge.h"
+#include <string.h>
+#include <time.h>
+
+// Guest instructions run between checks of the stop reason
+#define HEADLESS_BUDGET 1000000
+
+// Reads a whole file into a buffer the emulator takes ownership of
+unsigned char *read_program(const char *file_name)
+{
+    FILE *file = fopen(file_name, "rb");
+
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    rewind(file);
+
+    unsigned char *buffer = (unsigned char *)malloc(len);
+
+    if (fread(buffer, 1, len, file) != (size_t)len)
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+
+    fclose(file);
+    return buffer;
+}
+
+// Prints how to run the headless emulator
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] program.exe\n", name);
+    fprintf(stderr, "\t--keys <text>: Keys to type before reading stdin\n");
+    fprintf(stderr, "\t--budget <#>: Instructions run between checks of the stop reason\n");
+    fprintf(stderr, "\t--limit <#>: Stop after about this many instructions\n");
+    fprintf(stderr, "\t--jit: Compile hot code on hosts that support it\n");
+    fprintf(stderr, "\t--threshold <#>: Times a block runs before it is compiled\n");
+    fprintf(stderr, "\t--debug: Start in the debugger, commands are read from stdin\n");
+    fprintf(stderr, "\t--stats: Print instructions, run time and MIPS to stderr at the end\n");
+}
+
+// Runs a DOS program without a browser. Output goes to stdout, keys come from --keys and then stdin
+int main(int argc, char **argv)
+{
+    const char *keys = "";
+    const char *file_name = NULL;
+    long long budget = HEADLESS_BUDGET;
+    long long limit = 0;
+    bool jit = false;
+    int threshold = JIT_DEFAULT_THRESHOLD;
+    bool debug = false;
+    bool stats = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+
+        if (!strcmp(argv[i], "--keys") && has_value)
+            keys = argv[++i];
+        else if (!strcmp(argv[i], "--budget") && has_value)
+            budget = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--limit") && has_value)
+            limit = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--jit"))
+            jit = true;
+        else if (!strcmp(argv[i], "--threshold") && has_value)
+            threshold = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--debug"))
+            debug = true;
+        else if (!strcmp(argv[i], "--stats"))
+            stats = true;
+        else if (argv[i][0] != '-' && file_name == NULL)
+            file_name = argv[i];
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (file_name == NULL || budget <= 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    unsigned char *buffer = read_program(file_name);
+
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Could not read %s\n", file_name);
+        return 1;
+    }
+
+    DOSEmulator *emulator = new DOSEmulator(buffer, debug);
+
+    emulator->EnableJit(jit);
+    emulator->SetJitThreshold(threshold);
+    emulator->StartEmulation();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int reason;
+    char c;
+
+    do
+    {
+        reason = emulator->RunFor(budget);
+        emulator->PresentFrame();
+
+        if (reason == STOP_INPUT)
+        {
+            // Scripted keys go first, then whatever stdin has
+            if (*keys != '\0')
+                emulator->PushKey(*keys++);
+            else if (take_char(&c))
+                emulator->PushKey(c);
+            else
+            {
+                fprintf(stderr, "Input ended while the program waits for a key\n");
+                break;
+            }
+        }
+        else if (reason == STOP_BREAKPOINT)
+        {
+            while (!emulator->DebugCommand(take_line()))
+                ;
+        }
+
+        if (limit > 0 && emulator->GetInstructionsExecuted() >= limit)
+            break;
+    } while (reason != STOP_EXIT);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+
+    if (stats)
+    {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        long long instructions = emulator->GetInstructionsExecuted();
+        TIER_STATS tiers = emulator->GetTierStats();
+
+        fprintf(stderr, "Instructions: %lld\n", instructions);
+        fprintf(stderr, "Run time: %.3f s\n", seconds);
+        fprintf(stderr, "MIPS: %.1f\n", seconds > 0 ? instructions / seconds / 1e6 : 0.0);
+        fprintf(stderr, "Compiled: %lld instructions in %d blocks\n", tiers.jit_instrs, tiers.blocks_promoted);
+
+        FRAME_STATS frames = emulator->GetFrameStats();
+
+        fprintf(stderr, "Frames: %d with %d spans, %lld bytes uploaded\n", frames.frames, frames.spans, frames.total_bytes);
+    }
+
+    delete emulator;
+    return 0;
+}
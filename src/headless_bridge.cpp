@@ -0,0 +1,138 @@
+#include "bridge.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Bridge for native builds: program output goes to stdout, keys and debugger commands come from stdin.
+// There is no display, so the video commands are skipped
+
+// Longest line read for a debugger command or file name
+#define LINE_SIZE 256
+
+// Line read from stdin, with the newline the debugger commands expect
+char line_data[LINE_SIZE];
+
+// Reads a line from stdin, at the end of input it reads as the given fallback
+char *read_line(const char *fallback)
+{
+    if (fgets(line_data, LINE_SIZE - 1, stdin) == NULL)
+        strcpy(line_data, fallback);
+
+    // The last line of a script may not end with a newline
+    if (strchr(line_data, '\n') == NULL)
+        strcat(line_data, "\n");
+
+    return line_data;
+}
+
+// Nothing to ask for, the file name is read when it is taken
+void request_file()
+{
+}
+
+// Reads a file name from stdin and returns the whole file, NULL if it can't be read
+char *take_file()
+{
+    char *name = read_line("");
+
+    name[strcspn(name, "\n")] = '\0';
+
+    FILE *file = fopen(name, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", name);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    rewind(file);
+
+    char *data = (char *)malloc(len);
+
+    if (fread(data, 1, len, file) != (size_t)len)
+    {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    return data;
+}
+
+// Nothing to ask for, stdin is read when the line is taken
+void request_line()
+{
+}
+
+// Reads a debugger command from stdin, once input runs out the program continues
+char *take_line()
+{
+    return read_line("c\n");
+}
+
+// Nothing to ask for, stdin is read when the key is taken
+void request_char()
+{
+}
+
+// Reads the next key from stdin, returns false at the end of input
+bool take_char(char *c)
+{
+    int key = getchar();
+
+    if (key == EOF)
+        return false;
+
+    *c = key;
+    return true;
+}
+
+// There is no keyboard to ask
+void request_held_key()
+{
+}
+
+// No key is ever held down
+bool take_held_key(char *c)
+{
+    *c = '\0';
+    return true;
+}
+
+// Reads a word of the command stream
+int command_word(std::vector<unsigned char> &commands, size_t at)
+{
+    return commands[at] | (commands[at + 1] << 8);
+}
+
+// Writes program output to stdout, the other commands are for the display
+void send_commands(const unsigned char *first, int first_size, const unsigned char *second, int second_size)
+{
+    std::vector<unsigned char> commands(first, first + first_size);
+
+    commands.insert(commands.end(), second, second + second_size);
+
+    size_t i = 0;
+
+    while (i < commands.size())
+    {
+        switch (commands[i++])
+        {
+        case HOST_BACKGROUND:
+            i += 1;
+            break;
+        case HOST_WRITE:
+            fwrite(&commands[i + 2], 1, command_word(commands, i), stdout);
+            i += 2 + command_word(commands, i);
+            break;
+        }
+    }
+}
+
+// There is no display to show frames on
+void present_rows(const unsigned int *, int, int)
+{
+}
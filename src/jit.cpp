@@ -0,0 +1,1186 @@
+#include "./emulator.h"
+#include "./modrm_table.h"
+
+// Selects the JIT for this emulator, where it is not supported the interpreter keeps running everything
+void DOSEmulator::EnableJit(bool enable)
+{
+#ifdef JIT_SUPPORTED
+    jit_enabled = enable;
+#endif
+}
+
+// Sets how many times a block has to be entered before it is compiled, 1 compiles on the first visit
+void DOSEmulator::SetJitThreshold(int threshold)
+{
+    jit_threshold = threshold;
+}
+
+// Gets the counters of the tiers, for tuning the threshold
+TIER_STATS DOSEmulator::GetTierStats()
+{
+    return tier_stats;
+}
+
+// Prints the counters of the tiers
+void DOSEmulator::PrintTierStats()
+{
+    fprintf(stdout, "JIT: %s, threshold %d\n", jit_enabled ? "on" : "off", jit_threshold);
+    fprintf(stdout, "Blocks seen: %d\tpromoted: %d\trejected: %d\tflushes: %d\tinvalidated: %d\n",
+            tier_stats.blocks_seen, tier_stats.blocks_promoted, tier_stats.blocks_rejected, tier_stats.flushes,
+            tier_stats.invalidations);
+    fprintf(stdout, "Instructions interpreted: %lld\tcompiled: %lld\n",
+            instr_executed - tier_stats.jit_instrs, tier_stats.jit_instrs);
+}
+
+// Remembers the return address of a CALL the interpreter ran, so a compiled RET can predict it
+void DOSEmulator::PushReturnPrediction(int return_ip)
+{
+#ifdef JIT_SUPPORTED
+    if (!jit_enabled || jit_blocks == NULL)
+        return;
+
+    RETURN_PREDICTION *prediction = &return_stack[++return_top & (RETURN_STACK_SIZE - 1)];
+    int address = startAddress + return_ip;
+    JIT_BLOCK *block = &jit_blocks[address & (JIT_BLOCK_TABLE_SIZE - 1)];
+
+    prediction->ip = return_ip;
+    prediction->code = block->address == address ? block->code : NULL;
+#endif
+}
+
+// Drops the prediction of a RET the interpreter ran, keeping the CALLs and RETs paired
+void DOSEmulator::PopReturnPrediction()
+{
+#ifdef JIT_SUPPORTED
+    return_top--;
+#endif
+}
+
+#ifdef JIT_SUPPORTED
+
+#include <sys/mman.h>
+#include <cstring>
+#include <cstddef>
+
+// Generated blocks take the emulator in rdi and return the new instruction pointer
+typedef int (*JIT_FUNCTION)(DOSEmulator *emulator);
+
+// What the compiler does with a guest instruction
+#define JIT_UNSUPPORTED 0
+#define JIT_MOVE 1
+#define JIT_ALU 2
+#define JIT_BRANCH 3
+#define JIT_INCDEC 4
+
+// Operand layouts of the ALU opcodes
+#define JIT_FORM_E_G 0   // Mod R/M operand is the destination, reg field the source
+#define JIT_FORM_G_E 1   // reg field is the destination, Mod R/M operand the source
+#define JIT_FORM_ACC_IMM 2 // AL or AX with an immediate
+#define JIT_FORM_E_IMM 3 // Mod R/M operand with an immediate
+
+// Host registers used by the generated code, r8 holds the start of guest memory
+#define HOST_EAX 0
+#define HOST_ECX 1
+#define HOST_EDX 2
+#define HOST_ESI 6
+#define HOST_EDI 7
+
+// Most host code one block can take up, used to check the buffer has room before compiling
+#define JIT_MAX_BLOCK_BYTES ((JIT_MAX_BLOCK_INSTRS + 1) * JIT_MAX_INSTR_BYTES)
+
+static void Emit8(unsigned char *&code, unsigned char val)
+{
+    *code++ = val;
+}
+
+static void Emit16(unsigned char *&code, unsigned short val)
+{
+    memcpy(code, &val, 2);
+    code += 2;
+}
+
+static void Emit32(unsigned char *&code, unsigned int val)
+{
+    memcpy(code, &val, 4);
+    code += 4;
+}
+
+static void Emit64(unsigned char *&code, unsigned long long val)
+{
+    memcpy(code, &val, 8);
+    code += 8;
+}
+
+// movzx host_reg, byte/word [rdi + offset]
+static void EmitLoadState(unsigned char *&code, char host_reg, int offset, char width)
+{
+    Emit8(code, 0x0F);
+    Emit8(code, width == 2 ? 0xB7 : 0xB6);
+    Emit8(code, 0x80 | (host_reg << 3) | HOST_EDI);
+    Emit32(code, offset);
+}
+
+// mov byte/word [rdi + offset], host_reg
+static void EmitStoreState(unsigned char *&code, char host_reg, int offset, char width)
+{
+    if (width == 2)
+        Emit8(code, 0x66);
+    Emit8(code, width == 2 ? 0x89 : 0x88);
+    Emit8(code, 0x80 | (host_reg << 3) | HOST_EDI);
+    Emit32(code, offset);
+}
+
+// mov byte/word [rdi + offset], val
+static void EmitStoreStateImm(unsigned char *&code, int offset, unsigned short val, char width)
+{
+    if (width == 2)
+        Emit8(code, 0x66);
+    Emit8(code, width == 2 ? 0xC7 : 0xC6);
+    Emit8(code, 0x80 | HOST_EDI);
+    Emit32(code, offset);
+    if (width == 2)
+        Emit16(code, val);
+    else
+        Emit8(code, val);
+}
+
+// mov host_reg, val
+static void EmitMovImm(unsigned char *&code, char host_reg, unsigned int val)
+{
+    Emit8(code, 0xB8 + host_reg);
+    Emit32(code, val);
+}
+
+// mov host_reg, qword [rdi + offset]
+static void EmitLoadState64(unsigned char *&code, char host_reg, int offset)
+{
+    Emit8(code, 0x48);
+    Emit8(code, 0x8B);
+    Emit8(code, 0x80 | (host_reg << 3) | HOST_EDI);
+    Emit32(code, offset);
+}
+
+// movsx host_reg, byte/word [rdi + offset]
+static void EmitLoadStateSigned(unsigned char *&code, char host_reg, int offset, char width)
+{
+    Emit8(code, 0x0F);
+    Emit8(code, width == 2 ? 0xBF : 0xBE);
+    Emit8(code, 0x80 | (host_reg << 3) | HOST_EDI);
+    Emit32(code, offset);
+}
+
+// add qword [rdi + offset], val
+static void EmitAddState64(unsigned char *&code, int offset, int val)
+{
+    Emit8(code, 0x48);
+    Emit8(code, 0x81);
+    Emit8(code, 0x80 | HOST_EDI);
+    Emit32(code, offset);
+    Emit32(code, val);
+}
+
+// Emits a call of a host function that takes the emulator in rdi, keeping rdi and r8 and the stack
+// 16 byte aligned. Clobbers the registers the host calling convention doesn't save
+static void EmitHostCall(unsigned char *&code, unsigned long long function)
+{
+    Emit8(code, 0x57); // push rdi
+    Emit8(code, 0x41); // push r8
+    Emit8(code, 0x50);
+    Emit8(code, 0x48); // sub rsp, 8
+    Emit8(code, 0x83);
+    Emit8(code, 0xEC);
+    Emit8(code, 0x08);
+    Emit8(code, 0x48); // movabs rax, function
+    Emit8(code, 0xB8);
+    Emit64(code, function);
+    Emit8(code, 0xFF); // call rax
+    Emit8(code, 0xD0);
+    Emit8(code, 0x48); // add rsp, 8
+    Emit8(code, 0x83);
+    Emit8(code, 0xC4);
+    Emit8(code, 0x08);
+    Emit8(code, 0x41); // pop r8
+    Emit8(code, 0x58);
+    Emit8(code, 0x5F); // pop rdi
+}
+
+// The generated code indexes the return predictions by shifting
+static_assert(sizeof(RETURN_PREDICTION) == 16, "RETURN_PREDICTION must be 16 bytes");
+
+// Lazy flags operation each ALU operation records, indexed like the reg field with TEST last
+static const char lazy_ops[9] = {ADDITION, LOGIC, ADDITION, SUBTRACTION, LOGIC, SUBTRACTION, LOGIC, SUBTRACTION, LOGIC};
+
+// Gets the ALU operation of an instruction the compiler classified as JIT_ALU
+static int AluOperation(DECODED_INSTR *instr)
+{
+    if (instr->op <= 0x3d)
+        return instr->op >> 3;
+    if (instr->op <= 0x83)
+        return instr->reg;
+    return TEST;
+}
+
+// Gets the lazy flags operation an instruction classified as JIT_ALU or JIT_INCDEC records
+static int LazyOperation(DECODED_INSTR *instr)
+{
+    if (instr->op >= 0x40 && instr->op <= 0x4f)
+        return instr->op <= 0x47 ? INCREMENT : DECREMENT;
+    return lazy_ops[AluOperation(instr)];
+}
+
+// Decides how the compiler handles an instruction, only those the interpreter implements are taken
+static int ClassifyInstruction(DECODED_INSTR *instr)
+{
+    unsigned char op = instr->op;
+
+    // ADC and SBB read the carry, which the generated code doesn't track
+    if (op <= 0x3d && (op & 0x7) <= 5)
+        return ((op >> 3) == ADC || (op >> 3) == SBB) ? JIT_UNSUPPORTED : JIT_ALU;
+    if (op >= 0x80 && op <= 0x83)
+        return (instr->reg == ADC || instr->reg == SBB) ? JIT_UNSUPPORTED : JIT_ALU;
+    if (op == 0x84 || op == 0x85 || op == 0xa8 || op == 0xa9)
+        return JIT_ALU;
+
+    if (op >= 0x40 && op <= 0x4f)
+        return JIT_INCDEC;
+
+    if (op >= 0xb0 && op <= 0xbf)
+        return JIT_MOVE;
+    if (op == 0x88 || op == 0x8a || op == 0x8b || op == 0xc6)
+        return JIT_MOVE;
+
+    if (op == 0x74 || op == 0x75 || (op >= 0x7c && op <= 0x7f))
+        return JIT_BRANCH;
+    if (op == 0xc3 || op == 0xe8 || op == 0xeb)
+        return JIT_BRANCH;
+
+    return JIT_UNSUPPORTED;
+}
+
+// Tells whether a block has to end at an instruction, so the one after it starts a new block
+bool DOSEmulator::EndsJitBlock(DECODED_INSTR *instr)
+{
+    int kind = ClassifyInstruction(instr);
+
+    return kind != JIT_ALU && kind != JIT_MOVE && kind != JIT_INCDEC;
+}
+
+// Tells whether an instruction the compiler classified stores to guest memory, which can be the block's own code
+static bool StoresToMemory(DECODED_INSTR *instr, int kind)
+{
+    unsigned char op = instr->op;
+    bool stores;
+
+    if (kind == JIT_MOVE)
+        stores = op == 0x88 || op == 0xc6;
+    else if (kind == JIT_ALU)
+        stores = AluOperation(instr) != CMP && AluOperation(instr) != TEST && (op >= 0x80 || (op & 0x7) <= 1);
+    else
+        return false;
+
+    return stores && !modrm_table.entries[instr->modrm].is_register;
+}
+
+// Allocates the code buffer and block table on first use and drops every compiled block
+void DOSEmulator::ResetJit()
+{
+    if (jit_buffer == NULL)
+    {
+        void *buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (buffer == MAP_FAILED)
+        {
+            fprintf(stdout, "JIT: could not map the code buffer, using the interpreter\n");
+            jit_enabled = false;
+            return;
+        }
+
+        jit_buffer = (unsigned char *)buffer;
+        jit_blocks = new JIT_BLOCK[JIT_BLOCK_TABLE_SIZE];
+    }
+
+    for (int i = 0; i < JIT_BLOCK_TABLE_SIZE; i++)
+        jit_blocks[i].address = -1;
+
+    jit_exits.clear();
+    jit_used = 0;
+
+    ClearReturnPredictions();
+}
+
+// Forgets the blocks the return predictions point at, a RET then goes back through the run loop
+void DOSEmulator::ClearReturnPredictions()
+{
+    for (int i = 0; i < RETURN_STACK_SIZE; i++)
+    {
+        return_stack[i].ip = -1;
+        return_stack[i].code = NULL;
+    }
+}
+
+// Releases the code buffer and block table
+void DOSEmulator::FreeJit()
+{
+    if (jit_buffer == NULL)
+        return;
+
+    munmap(jit_buffer, JIT_BUFFER_SIZE);
+    delete[] jit_blocks;
+
+    jit_buffer = NULL;
+    jit_blocks = NULL;
+}
+
+// Sums the write generations of the pages under a block, it changes whenever one of them is written
+unsigned int DOSEmulator::BlockGeneration(int address, int length)
+{
+    unsigned int generation = 0;
+
+    for (int page = address >> CODE_PAGE_SHIFT; page <= (address + length - 1) >> CODE_PAGE_SHIFT; page++)
+        generation += page_generation[page & (CODE_PAGE_COUNT - 1)];
+
+    return generation;
+}
+
+// Runs the compiled block at the instruction pointer. Blocks are counted each time the interpreter
+// enters them and compiled once they reach the threshold. Returns false when the interpreter has
+// to take the next instruction
+bool DOSEmulator::RunJitBlock()
+{
+    int address = startAddress + ip;
+    JIT_BLOCK *block = &jit_blocks[address & (JIT_BLOCK_TABLE_SIZE - 1)];
+
+    // The guest wrote over the block since it was compiled, drop it along with the links into it
+    if (block->address == address && block->code != NULL && BlockGeneration(address, block->length) != block->generation)
+    {
+        UnlinkBlocks(address);
+        tier_stats.invalidations++;
+    }
+
+    if (block->address != address)
+    {
+        block->address = address;
+        block->code = NULL;
+        block->exec_count = 0;
+        block->promoted = false;
+        tier_stats.blocks_seen++;
+    }
+
+    // Cold blocks stay in the interpreter until they have run often enough to be worth compiling
+    if (block->code == NULL)
+    {
+        if (block->promoted || ++block->exec_count < jit_threshold)
+            return false;
+
+        CompileBlock(address, block);
+
+        if (block->code == NULL)
+        {
+            tier_stats.blocks_rejected++;
+            return false;
+        }
+
+        tier_stats.blocks_promoted++;
+    }
+
+    // The blocks count their own instructions since linked ones run several per call
+    jit_fuel = JIT_CHAIN_LIMIT;
+    jit_code_written = false;
+    instr_ip = ip;
+    ip = ((JIT_FUNCTION)block->code)(this);
+
+    return true;
+}
+
+// Called from generated code for a store to a page that isn't plain RAM, see SpecialStore. A store
+// over decoded code bumps the generation of its own page, the running block then has to stop
+unsigned char *DOSEmulator::JitSpecialStore(DOSEmulator *emulator, unsigned char *address, int size)
+{
+    unsigned int *generation = &emulator->page_generation[((address - emulator->memory) >> CODE_PAGE_SHIFT) & (CODE_PAGE_COUNT - 1)];
+    unsigned int before = *generation;
+    unsigned char *target = emulator->SpecialStore(address, size);
+
+    if (*generation != before)
+        emulator->jit_code_written = true;
+
+    return target;
+}
+
+// Called from generated code before an INC or DEC that is the first flags result of its block, the
+// carry it keeps has to be taken out of the record the instructions before the block left
+void DOSEmulator::JitResolveFlags(DOSEmulator *emulator)
+{
+    emulator->ResolveFlags();
+}
+
+// Patches every exit whose target block is compiled into a jump straight to the target's code
+void DOSEmulator::LinkExits()
+{
+    for (JIT_EXIT &exit : jit_exits)
+    {
+        JIT_BLOCK *target = &jit_blocks[exit.target & (JIT_BLOCK_TABLE_SIZE - 1)];
+
+        if (exit.linked || target->address != exit.target || target->code == NULL)
+            continue;
+
+        int rel = target->code - (exit.site + 5);
+
+        exit.site[0] = 0xE9; // jmp target
+        memcpy(exit.site + 1, &rel, 4);
+        exit.linked = true;
+    }
+}
+
+// Drops the block at a linear address and points the exits into it back at the run loop. Only
+// invalidation needs it, breakpoints turn the JIT off instead, see DebugArmed
+void DOSEmulator::UnlinkBlocks(int address)
+{
+    if (jit_blocks == NULL)
+        return;
+
+    for (JIT_EXIT &exit : jit_exits)
+    {
+        if (!exit.linked || exit.target != address)
+            continue;
+
+        int target_ip = exit.target - startAddress;
+
+        exit.site[0] = 0xB8; // mov eax, target_ip
+        memcpy(exit.site + 1, &target_ip, 4);
+        exit.linked = false;
+    }
+
+    if (jit_blocks[address & (JIT_BLOCK_TABLE_SIZE - 1)].address == address)
+        jit_blocks[address & (JIT_BLOCK_TABLE_SIZE - 1)].address = -1;
+
+    ClearReturnPredictions();
+}
+
+// Emits a return to the run loop with the instruction pointer to continue at. The mov is as long
+// as a jmp rel32 so LinkExits can later chain the exit straight to the target block
+void DOSEmulator::EmitExit(unsigned char *&code, int ip)
+{
+    JIT_EXIT exit = {code, startAddress + ip, false};
+    jit_exits.push_back(exit);
+
+    EmitMovImm(code, HOST_EAX, ip);
+    Emit8(code, 0xC3);
+}
+
+// Gets the offset of a member from the emulator pointer the generated code gets in rdi
+int DOSEmulator::StateOffset(void *field)
+{
+    return (unsigned char *)field - (unsigned char *)this;
+}
+
+// Gets the offset of a guest register of the given width
+int DOSEmulator::RegisterOffset(unsigned char reg, char width)
+{
+    if (width == 1)
+        return StateOffset(&ByteRegister(reg));
+    return StateOffset(&registers[reg].word);
+}
+
+// Emits code leaving the host address of a memory operand in rsi, clobbers edx. When the
+// operand is written it also emits the store check, clobbering eax and ecx
+void DOSEmulator::EmitOperandAddress(unsigned char *&code, DECODED_INSTR *instr, bool write)
+{
+    const MODRM_ENTRY &entry = modrm_table.entries[instr->modrm];
+
+    // edx = base + index + displacement, wrapped to 16 bits
+    if (entry.base != NO_REGISTER)
+    {
+        EmitLoadState(code, HOST_EDX, RegisterOffset(entry.base, 2), 2);
+    }
+    else
+    {
+        Emit8(code, 0x31); // xor edx, edx
+        Emit8(code, 0xD2);
+    }
+
+    if (entry.index != NO_REGISTER)
+    {
+        EmitLoadState(code, HOST_ESI, RegisterOffset(entry.index, 2), 2);
+        Emit8(code, 0x01); // add edx, esi
+        Emit8(code, 0xF2);
+    }
+
+    if (instr->disp)
+    {
+        Emit8(code, 0x81); // add edx, disp
+        Emit8(code, 0xC2);
+        Emit32(code, instr->disp);
+    }
+
+    Emit8(code, 0x0F); // movzx edx, dx
+    Emit8(code, 0xB7);
+    Emit8(code, 0xD2);
+
+    // rsi = cached segment base + edx
+    EmitLoadState64(code, HOST_ESI, StateOffset(&segment_bases[entry.segment]));
+    Emit8(code, 0x48); // add rsi, rdx
+    Emit8(code, 0x01);
+    Emit8(code, 0xD6);
+
+    if (!write)
+        return;
+
+    EmitStoreCheck(code, instr->width);
+}
+
+// Emits the page type check of a store of width bytes to rsi. Stores to pages that aren't plain RAM
+// call JitSpecialStore, which can move rsi. Clobbers eax, ecx and edx
+void DOSEmulator::EmitStoreCheck(unsigned char *&code, char width)
+{
+    // eax = rsi - memory, the linear address of the store
+    Emit8(code, 0x48); // mov rax, rsi
+    Emit8(code, 0x89);
+    Emit8(code, 0xF0);
+    Emit8(code, 0x4C); // sub rax, r8
+    Emit8(code, 0x29);
+    Emit8(code, 0xC0);
+
+    // cl = types of the pages of the first and last byte, like StoreAddress
+    Emit8(code, 0x8D); // lea ecx, [rax + width - 1]
+    Emit8(code, 0x48);
+    Emit8(code, width - 1);
+    Emit8(code, 0xC1); // shr ecx, MEMORY_PAGE_SHIFT
+    Emit8(code, 0xE9);
+    Emit8(code, MEMORY_PAGE_SHIFT);
+    Emit8(code, 0x81); // and ecx, MEMORY_PAGE_COUNT - 1
+    Emit8(code, 0xE1);
+    Emit32(code, MEMORY_PAGE_COUNT - 1);
+    Emit8(code, 0x0F); // movzx ecx, byte [rdi + rcx + page_types]
+    Emit8(code, 0xB6);
+    Emit8(code, 0x8C);
+    Emit8(code, 0x0F);
+    Emit32(code, StateOffset(page_types));
+    Emit8(code, 0xC1); // shr eax, MEMORY_PAGE_SHIFT
+    Emit8(code, 0xE8);
+    Emit8(code, MEMORY_PAGE_SHIFT);
+    Emit8(code, 0x25); // and eax, MEMORY_PAGE_COUNT - 1
+    Emit32(code, MEMORY_PAGE_COUNT - 1);
+    Emit8(code, 0x0A); // or cl, byte [rdi + rax + page_types]
+    Emit8(code, 0x8C);
+    Emit8(code, 0x07);
+    Emit32(code, StateOffset(page_types));
+
+    // Plain RAM skips the call
+    Emit8(code, 0x74); // jz done
+    unsigned char *skip = code;
+    Emit8(code, 0x00);
+
+    // rsi = JitSpecialStore(this, rsi, width)
+    EmitMovImm(code, HOST_EDX, width);
+    EmitHostCall(code, (unsigned long long)&JitSpecialStore);
+    Emit8(code, 0x48); // mov rsi, rax
+    Emit8(code, 0x89);
+    Emit8(code, 0xC6);
+
+    *skip = code - (skip + 1);
+}
+
+// Emits the check after a store in the middle of a block. When the store wrote over decoded code
+// the rest of the block may be stale, so it goes back to the run loop at next_ip and takes back
+// the skipped instructions it counted on entry
+void DOSEmulator::EmitCodeWrittenCheck(unsigned char *&code, int next_ip, int skipped)
+{
+    Emit8(code, 0x80); // cmp byte [rdi + jit_code_written], 0
+    Emit8(code, 0x80 | (7 << 3) | HOST_EDI);
+    Emit32(code, StateOffset(&jit_code_written));
+    Emit8(code, 0x00);
+    Emit8(code, 0x74); // jz done
+    unsigned char *skip = code;
+    Emit8(code, 0x00);
+
+    EmitStoreStateImm(code, StateOffset(&jit_code_written), false, 1);
+    EmitAddState64(code, StateOffset(&instr_executed), -skipped);
+    EmitAddState64(code, StateOffset(&tier_stats.jit_instrs), -skipped);
+    EmitMovImm(code, HOST_EAX, next_ip);
+    Emit8(code, 0xC3);
+
+    *skip = code - (skip + 1);
+}
+
+// Emits a zero extending load of the Mod R/M operand, memory operands need EmitOperandAddress first
+void DOSEmulator::EmitLoadOperand(unsigned char *&code, char host_reg, DECODED_INSTR *instr)
+{
+    const MODRM_ENTRY &entry = modrm_table.entries[instr->modrm];
+
+    if (entry.is_register)
+    {
+        EmitLoadState(code, host_reg, RegisterOffset(entry.base, instr->width), instr->width);
+        return;
+    }
+
+    // movzx host_reg, byte/word [rsi]
+    Emit8(code, 0x0F);
+    Emit8(code, instr->width == 2 ? 0xB7 : 0xB6);
+    Emit8(code, (host_reg << 3) | HOST_ESI);
+}
+
+// Emits a store to the Mod R/M operand, memory operands need EmitOperandAddress first
+void DOSEmulator::EmitStoreOperand(unsigned char *&code, char host_reg, DECODED_INSTR *instr)
+{
+    const MODRM_ENTRY &entry = modrm_table.entries[instr->modrm];
+
+    if (entry.is_register)
+    {
+        EmitStoreState(code, host_reg, RegisterOffset(entry.base, instr->width), instr->width);
+        return;
+    }
+
+    // mov byte/word [rsi], host_reg
+    if (instr->width == 2)
+        Emit8(code, 0x66);
+    Emit8(code, instr->width == 2 ? 0x89 : 0x88);
+    Emit8(code, (host_reg << 3) | HOST_ESI);
+}
+
+// Emits an ALU instruction, record_flags stores the lazy flags record the way UpdateFlags does
+void DOSEmulator::EmitAlu(unsigned char *&code, DECODED_INSTR *instr, bool record_flags)
+{
+    unsigned char op = instr->op;
+    char width = instr->width;
+    unsigned int mask = width == 2 ? 0xFFFF : 0xFF;
+    int operation = AluOperation(instr);
+    int form;
+
+    if (op <= 0x3d)
+    {
+        static const int forms[6] = {JIT_FORM_E_G, JIT_FORM_E_G, JIT_FORM_G_E, JIT_FORM_G_E, JIT_FORM_ACC_IMM, JIT_FORM_ACC_IMM};
+
+        form = forms[op & 0x7];
+    }
+    else if (op <= 0x83)
+    {
+        form = JIT_FORM_E_IMM;
+    }
+    else
+    {
+        form = (op <= 0x85) ? JIT_FORM_E_G : JIT_FORM_ACC_IMM;
+    }
+
+    bool write = form != JIT_FORM_G_E && operation != CMP && operation != TEST;
+
+    if (form != JIT_FORM_ACC_IMM && !modrm_table.entries[instr->modrm].is_register)
+        EmitOperandAddress(code, instr, write);
+
+    // eax = destination, ecx = source
+    switch (form)
+    {
+    case JIT_FORM_E_G:
+        EmitLoadOperand(code, HOST_EAX, instr);
+        EmitLoadState(code, HOST_ECX, RegisterOffset(instr->reg, width), width);
+        break;
+    case JIT_FORM_G_E:
+        EmitLoadState(code, HOST_EAX, RegisterOffset(instr->reg, width), width);
+        EmitLoadOperand(code, HOST_ECX, instr);
+        break;
+    case JIT_FORM_ACC_IMM:
+        EmitLoadState(code, HOST_EAX, RegisterOffset(AX, width), width);
+        EmitMovImm(code, HOST_ECX, instr->imm & mask);
+        break;
+    default:
+        EmitLoadOperand(code, HOST_EAX, instr);
+        EmitMovImm(code, HOST_ECX, instr->imm & mask);
+        break;
+    }
+
+    // edx = eax op ecx, done in 32 bits so the carry out stays in the result like in Alu
+    static const unsigned char host_ops[9] = {0x01, 0x09, 0x00, 0x00, 0x21, 0x29, 0x31, 0x29, 0x21};
+
+    Emit8(code, 0x89); // mov edx, eax
+    Emit8(code, 0xC2);
+    Emit8(code, host_ops[operation]);
+    Emit8(code, 0xCA);
+
+    if (operation != CMP && operation != TEST)
+    {
+        switch (form)
+        {
+        case JIT_FORM_G_E:
+            EmitStoreState(code, HOST_EDX, RegisterOffset(instr->reg, width), width);
+            break;
+        case JIT_FORM_ACC_IMM:
+            EmitStoreState(code, HOST_EDX, RegisterOffset(AX, width), width);
+            break;
+        default:
+            EmitStoreOperand(code, HOST_EDX, instr);
+            break;
+        }
+    }
+
+    if (!record_flags)
+        return;
+
+    EmitStoreState(code, HOST_EAX, StateOffset(&lazy_flags.val1), 2);
+    EmitStoreState(code, HOST_ECX, StateOffset(&lazy_flags.val2), 2);
+    Emit8(code, 0x89); // mov [rdi + result], edx
+    Emit8(code, 0x80 | (HOST_EDX << 3) | HOST_EDI);
+    Emit32(code, StateOffset(&lazy_flags.result));
+    EmitStoreStateImm(code, StateOffset(&lazy_flags.operation), lazy_ops[operation], 1);
+    EmitStoreStateImm(code, StateOffset(&lazy_flags.width), width, 1);
+    EmitStoreStateImm(code, StateOffset(&lazy_flags.pending), true, 1);
+}
+
+// Emits INC or DEC of a word register. record_flags stores the lazy flags record the way IncDec does,
+// after saving the carry carry_instr left, the flags result before it in the block or NULL if there is none
+void DOSEmulator::EmitIncDec(unsigned char *&code, DECODED_INSTR *instr, bool record_flags, DECODED_INSTR *carry_instr)
+{
+    bool increment = instr->op <= 0x47;
+    int offset = RegisterOffset(instr->reg, 2);
+
+    if (!record_flags)
+    {
+        // add/sub word [rdi + offset], 1
+        Emit8(code, 0x66);
+        Emit8(code, 0x83);
+        Emit8(code, 0x80 | ((increment ? 0 : 5) << 3) | HOST_EDI);
+        Emit32(code, offset);
+        Emit8(code, 0x01);
+        return;
+    }
+
+    EmitSaveCarry(code, carry_instr);
+
+    // edx = eax + 1 or eax - 1, done in 32 bits like IncDec
+    EmitLoadState(code, HOST_EAX, offset, 2);
+    Emit8(code, 0x8D); // lea edx, [rax +/- 1]
+    Emit8(code, 0x40 | (HOST_EDX << 3) | HOST_EAX);
+    Emit8(code, increment ? 0x01 : 0xFF);
+    EmitStoreState(code, HOST_EDX, offset, 2);
+
+    EmitStoreState(code, HOST_EAX, StateOffset(&lazy_flags.val1), 2);
+    EmitStoreStateImm(code, StateOffset(&lazy_flags.val2), 1, 2);
+    Emit8(code, 0x89); // mov [rdi + result], edx
+    Emit8(code, 0x80 | (HOST_EDX << 3) | HOST_EDI);
+    Emit32(code, StateOffset(&lazy_flags.result));
+    EmitStoreStateImm(code, StateOffset(&lazy_flags.operation), increment ? INCREMENT : DECREMENT, 1);
+    EmitStoreStateImm(code, StateOffset(&lazy_flags.width), 2, 1);
+    EmitStoreStateImm(code, StateOffset(&lazy_flags.pending), true, 1);
+}
+
+// Emits saving the carry an INC or DEC keeps into flags[CF]. carry_instr is the flags result before it
+// in the block, which recorded its flags, or NULL when the carry comes from before the block
+void DOSEmulator::EmitSaveCarry(unsigned char *&code, DECODED_INSTR *carry_instr)
+{
+    if (carry_instr == NULL)
+    {
+        EmitHostCall(code, (unsigned long long)&JitResolveFlags);
+        return;
+    }
+
+    switch (LazyOperation(carry_instr))
+    {
+    case INCREMENT:
+    case DECREMENT:
+        // It saved the carry it kept already
+        break;
+    case LOGIC:
+        EmitStoreStateImm(code, StateOffset(&flags[CF]), false, 1);
+        break;
+    default:
+        // The carry is the bit above the width of the unwrapped result, like CheckIfCarry
+        Emit8(code, 0x8B); // mov eax, [rdi + result]
+        Emit8(code, 0x80 | (HOST_EAX << 3) | HOST_EDI);
+        Emit32(code, StateOffset(&lazy_flags.result));
+        Emit8(code, 0xC1); // shr eax, width * 8
+        Emit8(code, 0xE8);
+        Emit8(code, carry_instr->width * 8);
+        Emit8(code, 0x83); // and eax, 1
+        Emit8(code, 0xE0);
+        Emit8(code, 0x01);
+        EmitStoreState(code, HOST_EAX, StateOffset(&flags[CF]), 1);
+        break;
+    }
+}
+
+// Emits the moves, which leave the flags alone like their interpreter versions
+void DOSEmulator::EmitMove(unsigned char *&code, DECODED_INSTR *instr)
+{
+    unsigned char op = instr->op;
+
+    if (op >= 0xb0 && op <= 0xbf)
+    {
+        EmitStoreStateImm(code, RegisterOffset(instr->reg, instr->width), instr->imm, instr->width);
+        return;
+    }
+
+    const MODRM_ENTRY &entry = modrm_table.entries[instr->modrm];
+
+    if (!entry.is_register)
+        EmitOperandAddress(code, instr, op == 0x88 || op == 0xc6);
+
+    switch (op)
+    {
+    case 0x88:
+        EmitLoadState(code, HOST_EAX, RegisterOffset(instr->reg, 1), 1);
+        EmitStoreOperand(code, HOST_EAX, instr);
+        break;
+    case 0x8a:
+    case 0x8b:
+        EmitLoadOperand(code, HOST_EAX, instr);
+        EmitStoreState(code, HOST_EAX, RegisterOffset(instr->reg, instr->width), instr->width);
+        break;
+    default:
+        EmitMovImm(code, HOST_EAX, instr->imm & 0xFF);
+        EmitStoreOperand(code, HOST_EAX, instr);
+        break;
+    }
+}
+
+// Emits the jump ending a block. Conditional jumps test the record the last ALU instruction of
+// the block stored, flags_instr, so the host condition codes match what GetFlag would give
+void DOSEmulator::EmitBranch(unsigned char *&code, DECODED_INSTR *instr, int next_ip, DECODED_INSTR *flags_instr)
+{
+    int target = next_ip + instr->imm;
+
+    switch (instr->op)
+    {
+    case 0xeb:
+        EmitExit(code, target);
+        return;
+    case 0xe8:
+    {
+        // sp -= 2, then the return address goes to ss:sp a byte at a time like Push, so the high byte
+        // wraps around to ss:0 when sp is 0xFFFF
+        EmitLoadState(code, HOST_EAX, RegisterOffset(SP, 2), 2);
+        Emit8(code, 0x83); // sub eax, 2
+        Emit8(code, 0xE8);
+        Emit8(code, 0x02);
+        Emit8(code, 0x0F); // movzx eax, ax
+        Emit8(code, 0xB7);
+        Emit8(code, 0xC0);
+        EmitStoreState(code, HOST_EAX, RegisterOffset(SP, 2), 2);
+
+        for (int half = 0; half < 2; half++)
+        {
+            EmitLoadState(code, HOST_EAX, RegisterOffset(SP, 2), 2);
+
+            if (half == 1)
+            {
+                Emit8(code, 0xFF); // inc eax
+                Emit8(code, 0xC0);
+                Emit8(code, 0x0F); // movzx eax, ax
+                Emit8(code, 0xB7);
+                Emit8(code, 0xC0);
+            }
+
+            EmitLoadState64(code, HOST_ESI, StateOffset(&segment_bases[SS]));
+            Emit8(code, 0x48); // add rsi, rax
+            Emit8(code, 0x01);
+            Emit8(code, 0xC6);
+            EmitStoreCheck(code, 1);
+            Emit8(code, 0xC6); // mov byte [rsi], half of next_ip
+            Emit8(code, 0x06);
+            Emit8(code, (next_ip >> (half * 8)) & 0xFF);
+        }
+
+        // Push the prediction, with the return address's block if it is compiled by the time the CALL runs
+        int return_address = startAddress + next_ip;
+        JIT_BLOCK *return_block = &jit_blocks[return_address & (JIT_BLOCK_TABLE_SIZE - 1)];
+
+        Emit8(code, 0x8B); // mov eax, [rdi + return_top]
+        Emit8(code, 0x80 | (HOST_EAX << 3) | HOST_EDI);
+        Emit32(code, StateOffset(&return_top));
+        Emit8(code, 0xFF); // inc eax
+        Emit8(code, 0xC0);
+        Emit8(code, 0x89); // mov [rdi + return_top], eax
+        Emit8(code, 0x80 | (HOST_EAX << 3) | HOST_EDI);
+        Emit32(code, StateOffset(&return_top));
+        Emit8(code, 0x83); // and eax, RETURN_STACK_SIZE - 1
+        Emit8(code, 0xE0);
+        Emit8(code, RETURN_STACK_SIZE - 1);
+        Emit8(code, 0xC1); // shl eax, 4
+        Emit8(code, 0xE0);
+        Emit8(code, 0x04);
+        Emit8(code, 0xC7); // mov dword [rdi + rax + return_stack.ip], next_ip
+        Emit8(code, 0x84);
+        Emit8(code, 0x07);
+        Emit32(code, StateOffset(&return_stack[0].ip));
+        Emit32(code, next_ip);
+        Emit8(code, 0x31); // xor ecx, ecx
+        Emit8(code, 0xC9);
+        Emit8(code, 0x48); // movabs rdx, return_block
+        Emit8(code, 0xBA);
+        Emit64(code, (unsigned long long)return_block);
+        Emit8(code, 0x81); // cmp dword [rdx + address], return_address
+        Emit8(code, 0xBA);
+        Emit32(code, offsetof(JIT_BLOCK, address));
+        Emit32(code, return_address);
+        Emit8(code, 0x75); // jne store
+        Emit8(code, 0x07);
+        Emit8(code, 0x48); // mov rcx, [rdx + code]
+        Emit8(code, 0x8B);
+        Emit8(code, 0x8A);
+        Emit32(code, offsetof(JIT_BLOCK, code));
+        Emit8(code, 0x48); // store: mov [rdi + rax + return_stack.code], rcx
+        Emit8(code, 0x89);
+        Emit8(code, 0x8C);
+        Emit8(code, 0x07);
+        Emit32(code, StateOffset(&return_stack[0].code));
+
+        EmitExit(code, target);
+        return;
+    }
+    case 0xc3:
+        // edx = word [ss:sp] read a byte at a time like Pop, the high byte wraps to ss:0 when sp is 0xFFFF.
+        // Then sp += 2
+        EmitLoadState(code, HOST_EAX, RegisterOffset(SP, 2), 2);
+        EmitLoadState64(code, HOST_ESI, StateOffset(&segment_bases[SS]));
+        Emit8(code, 0x0F); // movzx edx, byte [rsi + rax]
+        Emit8(code, 0xB6);
+        Emit8(code, 0x14);
+        Emit8(code, 0x06);
+        Emit8(code, 0xFF); // inc eax
+        Emit8(code, 0xC0);
+        Emit8(code, 0x0F); // movzx eax, ax
+        Emit8(code, 0xB7);
+        Emit8(code, 0xC0);
+        Emit8(code, 0x0F); // movzx ecx, byte [rsi + rax]
+        Emit8(code, 0xB6);
+        Emit8(code, 0x0C);
+        Emit8(code, 0x06);
+        Emit8(code, 0xC1); // shl ecx, 8
+        Emit8(code, 0xE1);
+        Emit8(code, 0x08);
+        Emit8(code, 0x09); // or edx, ecx
+        Emit8(code, 0xCA);
+        Emit8(code, 0xFF); // inc eax
+        Emit8(code, 0xC0);
+        EmitStoreState(code, HOST_EAX, RegisterOffset(SP, 2), 2);
+
+        // Pop the prediction, when it matches the popped address and has a block jump straight there
+        Emit8(code, 0x8B); // mov ecx, [rdi + return_top]
+        Emit8(code, 0x80 | (HOST_ECX << 3) | HOST_EDI);
+        Emit32(code, StateOffset(&return_top));
+        Emit8(code, 0x8D); // lea eax, [rcx - 1]
+        Emit8(code, 0x41);
+        Emit8(code, 0xFF);
+        Emit8(code, 0x89); // mov [rdi + return_top], eax
+        Emit8(code, 0x80 | (HOST_EAX << 3) | HOST_EDI);
+        Emit32(code, StateOffset(&return_top));
+        Emit8(code, 0x83); // and ecx, RETURN_STACK_SIZE - 1
+        Emit8(code, 0xE1);
+        Emit8(code, RETURN_STACK_SIZE - 1);
+        Emit8(code, 0xC1); // shl ecx, 4
+        Emit8(code, 0xE1);
+        Emit8(code, 0x04);
+        Emit8(code, 0x3B); // cmp edx, [rdi + rcx + return_stack.ip]
+        Emit8(code, 0x94);
+        Emit8(code, 0x0F);
+        Emit32(code, StateOffset(&return_stack[0].ip));
+        Emit8(code, 0x75); // jne miss
+        Emit8(code, 0x0F);
+        Emit8(code, 0x48); // mov rax, [rdi + rcx + return_stack.code]
+        Emit8(code, 0x8B);
+        Emit8(code, 0x84);
+        Emit8(code, 0x0F);
+        Emit32(code, StateOffset(&return_stack[0].code));
+        Emit8(code, 0x48); // test rax, rax
+        Emit8(code, 0x85);
+        Emit8(code, 0xC0);
+        Emit8(code, 0x74); // jz miss
+        Emit8(code, 0x02);
+        Emit8(code, 0xFF); // jmp rax
+        Emit8(code, 0xE0);
+        Emit8(code, 0x89); // miss: mov eax, edx
+        Emit8(code, 0xD0);
+        Emit8(code, 0xC3); // ret
+        return;
+    }
+
+    char width = flags_instr->width;
+
+    if (instr->op == 0x74 || instr->op == 0x75)
+    {
+        Emit8(code, 0x8B); // mov edx, [rdi + result]
+        Emit8(code, 0x80 | (HOST_EDX << 3) | HOST_EDI);
+        Emit32(code, StateOffset(&lazy_flags.result));
+        Emit8(code, 0xF7); // test edx, mask
+        Emit8(code, 0xC2);
+        Emit32(code, width == 2 ? 0xFFFF : 0xFF);
+    }
+    else
+    {
+        // SF != OF is the sign of the exact result: compare the signed operands of a subtraction,
+        // test the exact signed sum of an addition, logic clears OF so only the result's sign counts
+        switch (LazyOperation(flags_instr))
+        {
+        case SUBTRACTION:
+        case DECREMENT:
+            EmitLoadStateSigned(code, HOST_EAX, StateOffset(&lazy_flags.val1), width);
+            EmitLoadStateSigned(code, HOST_ECX, StateOffset(&lazy_flags.val2), width);
+            Emit8(code, 0x39); // cmp eax, ecx
+            Emit8(code, 0xC8);
+            break;
+        case ADDITION:
+        case INCREMENT:
+            EmitLoadStateSigned(code, HOST_EAX, StateOffset(&lazy_flags.val1), width);
+            EmitLoadStateSigned(code, HOST_ECX, StateOffset(&lazy_flags.val2), width);
+            Emit8(code, 0x01); // add eax, ecx
+            Emit8(code, 0xC8);
+            Emit8(code, 0x85); // test eax, eax
+            Emit8(code, 0xC0);
+            break;
+        default:
+            EmitLoadStateSigned(code, HOST_EAX, StateOffset(&lazy_flags.result), width);
+            Emit8(code, 0x85); // test eax, eax
+            Emit8(code, 0xC0);
+            break;
+        }
+    }
+
+    // The host jcc has the same encoding as the guest one, taken skips the fall through exit
+    Emit8(code, instr->op);
+    Emit8(code, 0x06);
+    EmitExit(code, next_ip);
+    EmitExit(code, target);
+}
+
+// Compiles the block of instructions starting at a linear address. The block stops before the
+// first instruction the compiler can't handle, which is left to the interpreter
+void DOSEmulator::CompileBlock(int address, JIT_BLOCK *block)
+{
+    DECODED_INSTR instrs[JIT_MAX_BLOCK_INSTRS];
+    int kinds[JIT_MAX_BLOCK_INSTRS];
+    int count = 0;
+    int last_alu = -1;
+    int length = 0;
+
+    while (count < JIT_MAX_BLOCK_INSTRS)
+    {
+        DECODED_INSTR *instr = &instrs[count];
+        DecodeInstruction(address + length, instr);
+
+        int kind = ClassifyInstruction(instr);
+
+        // A conditional jump can only be compiled when the instruction that set its flags is in the block
+        bool conditional = instr->op < 0x80;
+
+        if (kind == JIT_UNSUPPORTED || (kind == JIT_BRANCH && conditional && last_alu < 0))
+            break;
+
+        if (kind == JIT_ALU || kind == JIT_INCDEC)
+            last_alu = count;
+
+        kinds[count++] = kind;
+        length += instr->length;
+
+        if (kind == JIT_BRANCH)
+            break;
+    }
+
+    if (count > 0 && jit_used + JIT_MAX_BLOCK_BYTES > JIT_BUFFER_SIZE)
+    {
+        ResetJit();
+        tier_stats.flushes++;
+    }
+
+    block->address = address;
+    block->instr_count = count;
+    block->length = length;
+    block->generation = BlockGeneration(address, length);
+    block->code = NULL;
+    block->promoted = true;
+
+    if (count == 0)
+        return;
+
+    unsigned char *start = jit_buffer + jit_used;
+    unsigned char *code = start;
+    int next_ip = address - startAddress;
+
+    // Linked blocks jump here, when they've used up the fuel this hands back to the run loop
+    EmitMovImm(code, HOST_EAX, next_ip);
+    Emit8(code, 0xC3);
+
+    unsigned char *entry = code;
+
+    Emit8(code, 0xFF); // dec dword [rdi + fuel]
+    Emit8(code, 0x80 | (1 << 3) | HOST_EDI);
+    Emit32(code, StateOffset(&jit_fuel));
+    Emit8(code, 0x74); // jz start
+    Emit8(code, start - (code + 1));
+
+    // Linked blocks skip RunJitBlock, so each checks its own pages haven't been written since
+    for (int page = address >> CODE_PAGE_SHIFT; page <= (address + length - 1) >> CODE_PAGE_SHIFT; page++)
+    {
+        unsigned int *generation = &page_generation[page & (CODE_PAGE_COUNT - 1)];
+
+        Emit8(code, 0x81); // cmp dword [rdi + generation], current value
+        Emit8(code, 0x80 | (7 << 3) | HOST_EDI);
+        Emit32(code, StateOffset(generation));
+        Emit32(code, *generation);
+        Emit8(code, 0x75); // jne start
+        Emit8(code, start - (code + 1));
+    }
+
+    EmitAddState64(code, StateOffset(&instr_executed), count);
+    EmitAddState64(code, StateOffset(&tier_stats.jit_instrs), count);
+
+    // movabs r8, start of guest memory
+    Emit8(code, 0x49);
+    Emit8(code, 0xB8);
+    Emit64(code, (unsigned long long)memory);
+
+    // Only the last result can be seen by the flags, earlier ones are overwritten within the block,
+    // unless a store over the block's own code leaves it before the next flags result. An INC or DEC
+    // that records its flags takes the carry from the result before it, which has to record as well
+    bool record_flags[JIT_MAX_BLOCK_INSTRS] = {};
+    int carry_from[JIT_MAX_BLOCK_INSTRS];
+    int alu = -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        carry_from[i] = alu;
+
+        if (kinds[i] == JIT_ALU || kinds[i] == JIT_INCDEC)
+            alu = i;
+
+        if (alu >= 0 && (i == last_alu || (i < count - 1 && StoresToMemory(&instrs[i], kinds[i]))))
+            record_flags[alu] = true;
+    }
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (kinds[i] == JIT_INCDEC && record_flags[i] && carry_from[i] >= 0)
+            record_flags[carry_from[i]] = true;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        next_ip += instrs[i].length;
+
+        switch (kinds[i])
+        {
+        case JIT_ALU:
+            EmitAlu(code, &instrs[i], record_flags[i]);
+            break;
+        case JIT_MOVE:
+            EmitMove(code, &instrs[i]);
+            break;
+        case JIT_INCDEC:
+            EmitIncDec(code, &instrs[i], record_flags[i], carry_from[i] >= 0 ? &instrs[carry_from[i]] : NULL);
+            break;
+        default:
+            EmitBranch(code, &instrs[i], next_ip, last_alu >= 0 ? &instrs[last_alu] : NULL);
+            break;
+        }
+
+        // The last instruction leaves the block anyway, the next block checks the generations on entry
+        if (i < count - 1 && StoresToMemory(&instrs[i], kinds[i]))
+            EmitCodeWrittenCheck(code, next_ip, count - 1 - i);
+    }
+
+    if (kinds[count - 1] != JIT_BRANCH)
+        EmitExit(code, next_ip);
+
+    jit_used += code - start;
+    block->code = entry;
+
+    LinkExits();
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "./emulator.h"
 #include "bridge.h"
+#include <emscripten.h>
 
 unsigned char *get_buffer(const char *file_name)
 {
@@ -19,48 +20,149 @@ unsigned char *get_buffer(const char *file_name)
     return buffer;
 }
 
-// Main function
-int main()
+// Guest instructions run between two browser frames
+#define INSTRUCTIONS_PER_FRAME 250000
+
+// What the frame loop is waiting for
+#define STATE_MENU 0    // The user picking a program
+#define STATE_UPLOAD 1  // The user uploading their own file
+#define STATE_RUNNING 2 // Nothing, the program runs
+#define STATE_INPUT 3   // A key for the program
+#define STATE_DEBUG 4   // A debugger command
+
+int state;
+DOSEmulator *emulator;
+
+// Shows the list of programs and waits for a choice
+void ShowMenu()
 {
-    while (true)
-    {
-        fprintf(stdout, "Which of the following do you wish to run?\n");
-        fprintf(stdout, "\t1) HELLOM.EXE: Prints out Hello World\n");
-        fprintf(stdout, "\t2) KEY.EXE: Takes in input, if input is a character then capitalize, if period, exit\n");
-        fprintf(stdout, "\t3) PONG.EXE: Pong video game\n");
-        fprintf(stdout, "\t4) TEST.EXE: Tests moving values around registers and printing as ASCII\n");
-        fprintf(stdout, "\t5) Upload your own file\n");
+    fprintf(stdout, "Which of the following do you wish to run?\n");
+    fprintf(stdout, "\t1) HELLOM.EXE: Prints out Hello World\n");
+    fprintf(stdout, "\t2) KEY.EXE: Takes in input, if input is a character then capitalize, if period, exit\n");
+    fprintf(stdout, "\t3) PONG.EXE: Pong video game\n");
+    fprintf(stdout, "\t4) TEST.EXE: Tests moving values around registers and printing as ASCII\n");
+    fprintf(stdout, "\t5) Upload your own file\n");
 
-        char user_input = get_char_async();
+    request_char();
+    state = STATE_MENU;
+}
 
-        unsigned char *buffer;
+// Loads a program and starts running it from the next frame
+void StartProgram(unsigned char *buffer)
+{
+    // Initialize the emulator with the buffer and the debugger set to true; it is heap allocated because the decode cache and page generations are too large for the wasm stack
+    emulator = new DOSEmulator(buffer, true);
 
-        if (user_input == '1')
+    emulator->StartEmulation();
+    state = STATE_RUNNING;
+}
+
+// Runs once per browser frame. The emulator runs a slice of instructions and says why it stopped,
+// nothing here blocks, so whatever it waits for is asked of the frontend and checked next frame
+void Frame()
+{
+    char c;
+
+    switch (state)
+    {
+    case STATE_MENU:
+    {
+        if (!take_char(&c))
+            return;
+
+        if (c == '1')
         {
-            buffer = get_buffer("./examples/HELLOM.EXE");
+            StartProgram(get_buffer("./examples/HELLOM.EXE"));
         }
-        else if (user_input == '2')
+        else if (c == '2')
         {
-            buffer = get_buffer("./examples/KEY.EXE");
+            StartProgram(get_buffer("./examples/KEY.EXE"));
         }
-        else if (user_input == '3')
+        else if (c == '3')
         {
-            buffer = get_buffer("./examples/PONG.EXE");
+            StartProgram(get_buffer("./examples/PONG.EXE"));
         }
-        else if (user_input == '4')
+        else if (c == '4')
         {
-            buffer = get_buffer("./examples/TEST.EXE");
+            StartProgram(get_buffer("./examples/TEST.EXE"));
         }
         else
         {
-            // Get the file and set the buffer to its contents
-            buffer = (unsigned char *)get_file_async();
+            // Get the file, the program starts once it's uploaded
+            request_file();
+            state = STATE_UPLOAD;
         }
+        return;
+    }
+    case STATE_UPLOAD:
+    {
+        char *file = take_file();
 
-        // Initialize the emulator with the buffer and the debugger set to true
-        DOSEmulator emulator(buffer, true);
+        if (file != NULL)
+            StartProgram((unsigned char *)file);
+        return;
+    }
+    case STATE_INPUT:
+    {
+        if (!take_char(&c))
+            return;
 
-        // Start the emulator
-        emulator.StartEmulation();
+        emulator->PushKey(c);
+        state = STATE_RUNNING;
+        break;
     }
-}
\ No newline at end of file
+    case STATE_DEBUG:
+    {
+        char *line = take_line();
+
+        if (line == NULL)
+            return;
+
+        if (!emulator->DebugCommand(line))
+        {
+            request_line();
+            return;
+        }
+
+        state = STATE_RUNNING;
+        break;
+    }
+    }
+
+    // The key the program sees held down is the one the frontend reported last
+    if (take_held_key(&c))
+        emulator->SetHeldKey(c);
+
+    request_held_key();
+
+    int reason = emulator->RunFor(INSTRUCTIONS_PER_FRAME);
+
+    // Each browser frame is a retrace, the lines of the framebuffer that changed are drawn once
+    emulator->PresentFrame();
+
+    switch (reason)
+    {
+    case STOP_INPUT:
+        request_char();
+        state = STATE_INPUT;
+        break;
+    case STOP_BREAKPOINT:
+        request_line();
+        state = STATE_DEBUG;
+        break;
+    case STOP_EXIT:
+        delete emulator;
+        emulator = NULL;
+        ShowMenu();
+        break;
+    }
+}
+
+// Main function
+int main()
+{
+    ShowMenu();
+
+    // Hands the thread back to the browser, which calls Frame on every animation frame
+    emscripten_set_main_loop(Frame, 0, 1);
+}
@@ -0,0 +1,135 @@
+#include "./emulator.h"
+#include <cstring>
+#include <cstdlib>
+
+#ifdef GUARDED_MEMORY
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Emulator whose guard regions the fault handler reports, the last one to allocate its memory
+static DOSEmulator *guarded_emulator = NULL;
+
+// Size of the whole reservation, guest memory and its mirror with a guard region on each side
+#define GUARDED_RESERVATION (MEMORY_GUARD_SIZE + MEMORY_SIZE + MEMORY_SLACK + MEMORY_GUARD_SIZE)
+
+// Appends a value in hex with at least digits digits, the fault handler can't use printf
+static char *AppendHex(char *out, unsigned long value, int digits)
+{
+    char reversed[16];
+    int count = 0;
+
+    do
+    {
+        reversed[count++] = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value != 0 || count < digits);
+
+    while (count > 0)
+        *out++ = reversed[--count];
+
+    return out;
+}
+
+// Appends a string without its terminator
+static char *AppendText(char *out, const char *text)
+{
+    while (*text)
+        *out++ = *text++;
+
+    return out;
+}
+
+// Reports an access that left guest memory and ends the program, faults anywhere else crash as usual
+void DOSEmulator::HandleMemoryFault(int signal, siginfo_t *info, void *)
+{
+    DOSEmulator *emulator = guarded_emulator;
+    unsigned char *address = (unsigned char *)info->si_addr;
+
+    if (emulator == NULL || address < emulator->memory - MEMORY_GUARD_SIZE ||
+        address >= emulator->memory - MEMORY_GUARD_SIZE + GUARDED_RESERVATION)
+    {
+        ::signal(signal, SIG_DFL);
+        return;
+    }
+
+    // Only async-signal-safe calls are allowed here, so the message is put together by hand
+    char message[128];
+    char *end = AppendText(message, "Guest memory access out of range at ");
+
+    end = AppendHex(end, emulator->special_registers[CS].word, 4);
+    end = AppendText(end, ":");
+    end = AppendHex(end, emulator->instr_ip, 4);
+    end = AppendText(end, " (linear ");
+    end = AppendHex(end, (unsigned long)(address - emulator->memory), 1);
+    end = AppendText(end, ")\n");
+
+    write(STDOUT_FILENO, message, end - message);
+    _exit(1);
+}
+
+// Maps guest memory between two PROT_NONE guard regions. The 64K past 1 MiB maps the first 64K of
+// the same pages again, so segment:offset pairs wrap around like on an 8086 without any checks
+void DOSEmulator::AllocateMemory()
+{
+    unsigned char *reservation = (unsigned char *)mmap(NULL, GUARDED_RESERVATION, PROT_NONE,
+                                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    int fd = memfd_create("guest-memory", 0);
+
+    if (reservation == MAP_FAILED || fd < 0 || ftruncate(fd, MEMORY_SIZE) != 0)
+    {
+        fprintf(stdout, "Could not map guest memory\n");
+        exit(1);
+    }
+
+    unsigned char *start = reservation + MEMORY_GUARD_SIZE;
+
+    if (mmap(start, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(start + MEMORY_SIZE, MEMORY_SLACK, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        fprintf(stdout, "Could not map guest memory\n");
+        exit(1);
+    }
+
+    close(fd);
+
+    memory = start;
+    guarded_emulator = this;
+
+    struct sigaction action = {};
+    action.sa_sigaction = HandleMemoryFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+}
+
+// Unmaps guest memory along with its guard regions
+void DOSEmulator::FreeMemory()
+{
+    if (memory == NULL)
+        return;
+
+    munmap(memory - MEMORY_GUARD_SIZE, GUARDED_RESERVATION);
+
+    if (guarded_emulator == this)
+        guarded_emulator = NULL;
+
+    memory = NULL;
+}
+
+#else
+
+// Allocates guest memory from the heap, the 64K past 1 MiB is a separate area instead of a mirror
+void DOSEmulator::AllocateMemory()
+{
+    memory = new unsigned char[MEMORY_SIZE + MEMORY_SLACK]();
+}
+
+// Releases guest memory
+void DOSEmulator::FreeMemory()
+{
+    delete[] memory;
+    memory = NULL;
+}
+
+#endif
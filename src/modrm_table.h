@@ -0,0 +1,51 @@
+// Compile time table describing the operand of every Mod R/M byte, shared by the interpreter and the JIT
+#pragma once
+
+#include "./emulator.h"
+
+// Builds the descriptor of one Mod R/M byte
+static constexpr MODRM_ENTRY MakeModRMEntry(int modrm)
+{
+    int mod = (modrm >> 6) & 0x3;
+    int rm = modrm & 0x7;
+    MODRM_ENTRY entry = {NO_REGISTER, NO_REGISTER, 0, DS, false};
+
+    if (mod == 0x3)
+    {
+        entry.base = rm;
+        entry.is_register = true;
+        return entry;
+    }
+
+    const unsigned char bases[8] = {BX, BX, BP, BP, NO_REGISTER, NO_REGISTER, BP, BX};
+    const unsigned char indexes[8] = {SI, DI, SI, DI, SI, DI, NO_REGISTER, NO_REGISTER};
+
+    entry.base = bases[rm];
+    entry.index = indexes[rm];
+    entry.disp_size = (mod == 0x2) ? 2 : mod;
+
+    // mod 0 r/m 6 is a direct address instead of [BP]
+    if (mod == 0x0 && rm == 0x6)
+    {
+        entry.base = NO_REGISTER;
+        entry.disp_size = 2;
+    }
+
+    if (entry.base == BP)
+        entry.segment = SS;
+
+    return entry;
+}
+
+// Builds the descriptors of every Mod R/M byte
+static constexpr MODRM_TABLE BuildModRMTable()
+{
+    MODRM_TABLE table = {};
+
+    for (int i = 0; i < 256; i++)
+        table.entries[i] = MakeModRMEntry(i);
+
+    return table;
+}
+
+static constexpr MODRM_TABLE modrm_table = BuildModRMTable();
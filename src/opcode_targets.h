@@ -0,0 +1,15 @@
+// Computed goto table for the threaded dispatch in RunLoop, entry n jumps to the op_0xNN handler
+#define OPCODE_TARGET_ROW(h)                                                \
+    &&op_0x##h##0, &&op_0x##h##1, &&op_0x##h##2, &&op_0x##h##3,             \
+    &&op_0x##h##4, &&op_0x##h##5, &&op_0x##h##6, &&op_0x##h##7,             \
+    &&op_0x##h##8, &&op_0x##h##9, &&op_0x##h##a, &&op_0x##h##b,             \
+    &&op_0x##h##c, &&op_0x##h##d, &&op_0x##h##e, &&op_0x##h##f
+
+static void *opcode_targets[256] = {
+    OPCODE_TARGET_ROW(0), OPCODE_TARGET_ROW(1), OPCODE_TARGET_ROW(2), OPCODE_TARGET_ROW(3),
+    OPCODE_TARGET_ROW(4), OPCODE_TARGET_ROW(5), OPCODE_TARGET_ROW(6), OPCODE_TARGET_ROW(7),
+    OPCODE_TARGET_ROW(8), OPCODE_TARGET_ROW(9), OPCODE_TARGET_ROW(a), OPCODE_TARGET_ROW(b),
+    OPCODE_TARGET_ROW(c), OPCODE_TARGET_ROW(d), OPCODE_TARGET_ROW(e), OPCODE_TARGET_ROW(f),
+};
+
+#undef OPCODE_TARGET_ROW
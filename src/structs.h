@@ -29,3 +29,91 @@ typedef struct RELOCATION
     short segment_value;
 } RELOCATION;
 
+
+typedef union REGISTER
+{
+    unsigned short word;  // Full 16 bit value
+    unsigned char byte[2]; // 8 bit halves, indexed with HIGH_BYTE and LOW_BYTE
+} REGISTER;
+
+typedef struct DECODED_INSTR
+{
+    int address;             // Linear address the record was decoded from, -1 if the slot is empty
+    unsigned int generation; // Write generation of the page at address when it was decoded
+    unsigned char length;    // Number of bytes the instruction occupies
+    unsigned char op;        // Primary opcode
+    unsigned char format;    // Format flags from the opcode table
+    unsigned char width;     // Operand width in bytes
+    unsigned char reg;       // Reg field of the Mod R/M byte or register encoded in the opcode
+    unsigned char modrm;     // Mod R/M byte, indexes the Mod R/M table
+    short disp;              // Displacement, or the direct address when mod is 0 and r/m is 6
+    short imm;               // Immediate value, relative target or prefixed opcode
+    short imm2;              // Second immediate (segment of a far pointer)
+    bool block_end;          // The JIT can't run the instruction inside a block, so the next one starts a block
+} DECODED_INSTR;
+
+typedef struct JIT_BLOCK
+{
+    int address;             // Linear address of the first instruction, -1 if the slot is empty
+    unsigned char *code;     // Generated host code, NULL when the first instruction can't be compiled
+    int instr_count;         // Number of guest instructions the block runs
+    int length;              // Bytes of guest code the block was compiled from
+    unsigned int generation; // Sum of the write generations of the pages under the block when compiled
+    int exec_count;          // Times the interpreter entered the block before it was promoted
+    bool promoted;           // True once the block crossed the threshold and compiling it was tried
+} JIT_BLOCK;
+
+typedef struct JIT_EXIT
+{
+    unsigned char *site; // Start of the exit's mov eax, ip in the code buffer, patched to a jmp when linked
+    int target;          // Linear address the exit continues at
+    bool linked;         // True while the exit jumps straight into the target's block
+} JIT_EXIT;
+
+typedef struct RETURN_PREDICTION
+{
+    int ip;              // Instruction pointer the CALL pushed
+    unsigned char *code; // Compiled block at the return address when the CALL ran, NULL if there was none
+} RETURN_PREDICTION;
+
+typedef struct TIER_STATS
+{
+    int blocks_seen;      // Block entries the interpreter started counting
+    int blocks_promoted;  // Blocks compiled after crossing the threshold
+    int blocks_rejected;  // Blocks that crossed the threshold but start with an instruction the JIT can't take
+    int flushes;          // Times the code buffer filled up and every block was dropped
+    int invalidations;    // Compiled blocks dropped because the guest wrote over their code
+    long long jit_instrs; // Guest instructions run by compiled blocks
+} TIER_STATS;
+
+typedef struct FRAME_STATS
+{
+    int frames;            // Frames that had changed scanlines to hand to the host
+    int spans;             // Runs of consecutive changed scanlines handed to the host
+    int last_frame_bytes;  // Framebuffer bytes handed over for the last frame
+    long long total_bytes; // Framebuffer bytes handed over for all frames
+} FRAME_STATS;
+
+typedef struct MODRM_ENTRY
+{
+    unsigned char base;      // BX or BP, NO_REGISTER if unused, or the register itself when mod is 3
+    unsigned char index;     // SI or DI, NO_REGISTER if unused
+    unsigned char disp_size; // Bytes of displacement following the Mod R/M byte
+    unsigned char segment;   // Default segment, SS when the base is BP
+    bool is_register;        // True when mod is 3 and the operand is a register
+} MODRM_ENTRY;
+
+typedef struct MODRM_TABLE
+{
+    MODRM_ENTRY entries[256]; // Descriptor for every Mod R/M byte
+} MODRM_TABLE;
+
+typedef struct LAZY_FLAGS
+{
+    unsigned short val1;  // First operand of the last arithmetic instruction
+    unsigned short val2;  // Second operand of the last arithmetic instruction
+    unsigned int result;  // Result before truncation so the carry out is kept
+    char operation;       // ADDITION, SUBTRACTION, LOGIC, INCREMENT, DECREMENT or SHIFT_RIGHT
+    char width;           // Operand width in bytes
+    bool pending;         // True while the arithmetic flags still have to be computed from this record
+} LAZY_FLAGS;
@@ -0,0 +1,531 @@
+#include "./emulator.h"
+#include "./font.h"
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+// Levels of the 24 hue runs in the default VGA palette, from the darkest to the brightest
+// component, for 3 intensities times 3 saturations
+static const unsigned char hue_levels[9][5] = {
+    {0, 16, 31, 47, 63}, {31, 39, 47, 55, 63}, {45, 49, 54, 58, 63},
+    {0, 7, 14, 21, 28},  {14, 17, 21, 24, 28}, {20, 22, 24, 26, 28},
+    {0, 4, 8, 12, 16},   {8, 10, 12, 14, 16},  {11, 12, 13, 15, 16},
+};
+
+// The 16 colors every VGA mode starts with, as 6 bit DAC values
+static const unsigned char text_colors[16][3] = {
+    {0, 0, 0},   {0, 0, 42},   {0, 42, 0},   {0, 42, 42},   {42, 0, 0},   {42, 0, 42},   {42, 21, 0},   {42, 42, 42},
+    {21, 21, 21}, {21, 21, 63}, {21, 63, 21}, {21, 63, 63}, {63, 21, 21}, {63, 21, 63}, {63, 63, 21}, {63, 63, 63},
+};
+
+// Gray ramp in the 16 entries after the text colors
+static const unsigned char gray_levels[16] = {0, 5, 8, 11, 14, 17, 20, 24, 28, 32, 36, 40, 45, 50, 56, 63};
+
+// Sets a palette entry from 6 bit DAC values, the frame is converted again since pixels of that color changed
+void DOSEmulator::SetDacColor(int index, unsigned char red, unsigned char green, unsigned char blue)
+{
+    red &= 0x3f;
+    green &= 0x3f;
+    blue &= 0x3f;
+
+    // RGBA bytes in memory order, the host reads the output as bytes
+    unsigned char rgba[4] = {(unsigned char)((red << 2) | (red >> 4)), (unsigned char)((green << 2) | (green >> 4)),
+                             (unsigned char)((blue << 2) | (blue >> 4)), 0xff};
+
+    memcpy(&palette[index & 0xff], rgba, 4);
+
+    video_dirty = true;
+    memset(dirty_lines, 0xff, sizeof(dirty_lines));
+
+    // Text cells are colored with the first 16 entries
+    if ((index & 0xff) < 16)
+        InvalidateText();
+}
+
+// Loads the palette mode 13h starts with: the text colors, a gray ramp and 9 runs of 24 hues
+void DOSEmulator::SetDefaultPalette()
+{
+    for (int i = 0; i < 16; i++)
+        SetDacColor(i, text_colors[i][0], text_colors[i][1], text_colors[i][2]);
+
+    for (int i = 0; i < 16; i++)
+        SetDacColor(16 + i, gray_levels[i], gray_levels[i], gray_levels[i]);
+
+    // Each run goes blue, magenta, red, yellow, green, cyan and back, 4 steps between each
+    for (int run = 0; run < 9; run++)
+    {
+        const unsigned char *level = hue_levels[run];
+
+        for (int step = 0; step < 24; step++)
+        {
+            int side = step / 4;
+            int rise = level[step % 4];
+            int fall = level[4 - step % 4];
+            unsigned char lo = level[0];
+            unsigned char hi = level[4];
+            unsigned char rgb[6][3] = {
+                {(unsigned char)rise, lo, hi}, {hi, lo, (unsigned char)fall}, {hi, (unsigned char)rise, lo},
+                {(unsigned char)fall, hi, lo}, {lo, hi, (unsigned char)rise}, {lo, (unsigned char)fall, hi},
+            };
+
+            SetDacColor(32 + run * 24 + step, rgb[side][0], rgb[side][1], rgb[side][2]);
+        }
+    }
+
+    for (int i = 248; i < 256; i++)
+        SetDacColor(i, 0, 0, 0);
+}
+
+// Handles a write to an I/O port, only the DAC ports are emulated
+void DOSEmulator::WritePort(unsigned short port, unsigned char val)
+{
+    switch (port)
+    {
+    case DAC_WRITE_INDEX:
+    {
+        dac_index = val;
+        dac_component = 0;
+        break;
+    }
+    case DAC_DATA:
+    {
+        // Red, green and blue are written one after the other, then the index moves on
+        dac_rgb[dac_component++] = val;
+
+        if (dac_component == 3)
+        {
+            SetDacColor(dac_index++, dac_rgb[0], dac_rgb[1], dac_rgb[2]);
+            dac_component = 0;
+        }
+        break;
+    }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Converts a scanline with SSE2: 4 palette lookups, then each color is doubled by interleaving the
+// register with itself
+static void ConvertLineSSE2(const unsigned char *pixels, const unsigned int *palette, unsigned int *out)
+{
+    for (int x = 0; x < VGA_WIDTH; x += 4)
+    {
+        __m128i colors = _mm_setr_epi32(palette[pixels[x]], palette[pixels[x + 1]], palette[pixels[x + 2]],
+                                        palette[pixels[x + 3]]);
+
+        _mm_storeu_si128((__m128i *)(out + x * 2), _mm_unpacklo_epi32(colors, colors));
+        _mm_storeu_si128((__m128i *)(out + x * 2 + 4), _mm_unpackhi_epi32(colors, colors));
+    }
+}
+
+// Converts a scanline with AVX2: 8 pixels are looked up with one gather and doubled with a permute
+__attribute__((target("avx2"))) static void ConvertLineAVX2(const unsigned char *pixels, const unsigned int *palette,
+                                                             unsigned int *out)
+{
+    const __m256i low = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i high = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+
+    for (int x = 0; x < VGA_WIDTH; x += 8)
+    {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(pixels + x)));
+        __m256i colors = _mm256_i32gather_epi32((const int *)palette, indices, 4);
+
+        _mm256_storeu_si256((__m256i *)(out + x * 2), _mm256_permutevar8x32_epi32(colors, low));
+        _mm256_storeu_si256((__m256i *)(out + x * 2 + 8), _mm256_permutevar8x32_epi32(colors, high));
+    }
+}
+
+// Picks the widest kernel the host runs
+static void (*SelectConvertLine())(const unsigned char *, const unsigned int *, unsigned int *)
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return ConvertLineAVX2;
+
+    return ConvertLineSSE2;
+}
+
+#elif defined(__wasm_simd128__)
+
+// Converts a scanline with WebAssembly SIMD: 4 palette lookups, then each color is doubled with a shuffle
+static void ConvertLineWasm(const unsigned char *pixels, const unsigned int *palette, unsigned int *out)
+{
+    for (int x = 0; x < VGA_WIDTH; x += 4)
+    {
+        v128_t colors = wasm_u32x4_make(palette[pixels[x]], palette[pixels[x + 1]], palette[pixels[x + 2]],
+                                        palette[pixels[x + 3]]);
+
+        wasm_v128_store(out + x * 2, wasm_i32x4_shuffle(colors, colors, 0, 0, 1, 1));
+        wasm_v128_store(out + x * 2 + 4, wasm_i32x4_shuffle(colors, colors, 2, 2, 3, 3));
+    }
+}
+
+static void (*SelectConvertLine())(const unsigned char *, const unsigned int *, unsigned int *)
+{
+    return ConvertLineWasm;
+}
+
+#else
+
+// Converts a scanline of indexed pixels to RGBA with every pixel doubled, one pixel at a time
+static void ConvertLineScalar(const unsigned char *pixels, const unsigned int *palette, unsigned int *out)
+{
+    for (int x = 0; x < VGA_WIDTH; x++)
+    {
+        unsigned int color = palette[pixels[x]];
+
+        out[x * 2] = color;
+        out[x * 2 + 1] = color;
+    }
+}
+
+static void (*SelectConvertLine())(const unsigned char *, const unsigned int *, unsigned int *)
+{
+    return ConvertLineScalar;
+}
+
+#endif
+
+// Kernel every emulator converts scanlines with, picked once for the host
+static void (*const ConvertLine)(const unsigned char *, const unsigned int *, unsigned int *) = SelectConvertLine();
+
+// Converts mode 13h scanlines into the 640x400 RGBA output, each scanline becomes two identical rows
+void DOSEmulator::ConvertScanlines(int first, int count)
+{
+    for (int line = first; line < first + count; line++)
+    {
+        unsigned int *row = frame_rgba + line * 2 * FRAME_WIDTH;
+
+        ConvertLine(memory + VGA_MEMORY_START + line * VGA_WIDTH, palette, row);
+        memcpy(row + FRAME_WIDTH, row, FRAME_WIDTH * 4);
+    }
+}
+
+// Marks the display dirty, and the scanlines of the mode 13h framebuffer or the rows of the text
+// screen a store to video memory touches
+void DOSEmulator::MarkScanlines(int linear, int size)
+{
+    video_dirty = true;
+
+    if (linear >= TEXT_MEMORY_START)
+    {
+        int start = linear - TEXT_MEMORY_START;
+        int end = std::min(start + size - 1, TEXT_COLUMNS * TEXT_ROWS * 2 - 1);
+
+        for (int row = start / (TEXT_COLUMNS * 2); row <= end / (TEXT_COLUMNS * 2); row++)
+            text_dirty_rows |= 1u << row;
+        return;
+    }
+
+    int start = std::max(linear - VGA_MEMORY_START, 0);
+    int end = std::min(linear + size - 1 - VGA_MEMORY_START, VGA_WIDTH * VGA_HEIGHT - 1);
+
+    for (int line = start / VGA_WIDTH; line <= end / VGA_WIDTH; line++)
+        dirty_lines[line >> 6] |= 1ull << (line & 63);
+}
+
+// Hands the part of the display that changed since the last frame to the host. The host calls it
+// after RunFor, once per retrace, a display that didn't change costs nothing
+void DOSEmulator::PresentFrame()
+{
+    if (!video_dirty)
+        return;
+
+    video_dirty = false;
+
+    int bytes = video_mode ? PresentScanlines() : PresentText();
+
+    memset(dirty_lines, 0, sizeof(dirty_lines));
+    text_dirty_rows = 0;
+
+    if (bytes > 0)
+    {
+        frame_stats.frames++;
+        frame_stats.last_frame_bytes = bytes;
+        frame_stats.total_bytes += bytes;
+    }
+}
+
+// Converts the runs of mode 13h scanlines that changed and hands their rows of the RGBA output to the host.
+// Returns the bytes handed over
+int DOSEmulator::PresentScanlines()
+{
+    int line = 0;
+    int bytes = 0;
+
+    while (line < VGA_HEIGHT)
+    {
+        // Skip 64 clean lines at once
+        if (dirty_lines[line >> 6] == 0)
+        {
+            line = (line | 63) + 1;
+            continue;
+        }
+
+        if (!(dirty_lines[line >> 6] & (1ull << (line & 63))))
+        {
+            line++;
+            continue;
+        }
+
+        int first = line;
+
+        while (line < VGA_HEIGHT && (dirty_lines[line >> 6] & (1ull << (line & 63))))
+            line++;
+
+        ConvertScanlines(first, line - first);
+        present_rows(frame_rgba + first * 2 * FRAME_WIDTH, first * 2, (line - first) * 2);
+
+        bytes += (line - first) * 2 * FRAME_WIDTH * 4;
+        frame_stats.spans++;
+    }
+
+    return bytes;
+}
+
+// Fills the text screen with blanks and puts the cursor in the top left corner
+void DOSEmulator::ClearText()
+{
+    unsigned char *cells = StoreRange(memory + TEXT_MEMORY_START, TEXT_COLUMNS * TEXT_ROWS * 2);
+
+    for (int i = 0; i < TEXT_COLUMNS * TEXT_ROWS; i++)
+    {
+        cells[i * 2] = ' ';
+        cells[i * 2 + 1] = TEXT_ATTRIBUTE;
+    }
+
+    vCursor->row = 0;
+    vCursor->column = 0;
+}
+
+// Moves the screen up a row of characters and blanks the bottom row
+void DOSEmulator::ScrollScreen()
+{
+    if (video_mode)
+    {
+        unsigned char *pixels = StoreRange(memory + VGA_MEMORY_START, VGA_WIDTH * VGA_HEIGHT);
+        int row_bytes = VGA_WIDTH * ROM_GLYPH_HEIGHT;
+
+        memmove(pixels, pixels + row_bytes, VGA_WIDTH * VGA_HEIGHT - row_bytes);
+        memset(pixels + VGA_WIDTH * VGA_HEIGHT - row_bytes, 0, row_bytes);
+        return;
+    }
+
+    unsigned char *cells = StoreRange(memory + TEXT_MEMORY_START, TEXT_COLUMNS * TEXT_ROWS * 2);
+    unsigned char *last = cells + (TEXT_ROWS - 1) * TEXT_COLUMNS * 2;
+
+    memmove(cells, cells + TEXT_COLUMNS * 2, (TEXT_ROWS - 1) * TEXT_COLUMNS * 2);
+
+    for (int i = 0; i < TEXT_COLUMNS; i++)
+    {
+        last[i * 2] = ' ';
+        last[i * 2 + 1] = TEXT_ATTRIBUTE;
+    }
+}
+
+// Puts a character on the screen. In text mode it goes into the cell, which keeps its attribute when
+// attribute is negative. In mode 13h its glyph is drawn into the framebuffer in the attribute's color on
+// black, or light gray when attribute is negative
+void DOSEmulator::PutCharacter(unsigned char character, int attribute, int column, int row)
+{
+    if (!video_mode)
+    {
+        if (column >= TEXT_COLUMNS || row >= TEXT_ROWS)
+            return;
+
+        unsigned char *cell = StoreRange(memory + TEXT_MEMORY_START + (row * TEXT_COLUMNS + column) * 2, attribute < 0 ? 1 : 2);
+
+        cell[0] = character;
+
+        if (attribute >= 0)
+            cell[1] = attribute;
+        return;
+    }
+
+    if (column >= GRAPHICS_COLUMNS || row >= GRAPHICS_ROWS)
+        return;
+
+    unsigned char color = attribute < 0 ? TEXT_ATTRIBUTE : attribute;
+    unsigned char *pixels = StoreRange(memory + VGA_MEMORY_START + (row * ROM_GLYPH_HEIGHT * VGA_WIDTH) + column * GLYPH_WIDTH,
+                                       (ROM_GLYPH_HEIGHT - 1) * VGA_WIDTH + GLYPH_WIDTH);
+
+    for (int y = 0; y < ROM_GLYPH_HEIGHT; y++)
+    {
+        unsigned char bits = character < 128 ? rom_font[character][y] : 0;
+
+        for (int x = 0; x < GLYPH_WIDTH; x++)
+            pixels[y * VGA_WIDTH + x] = (bits & (0x80 >> x)) ? color : 0;
+    }
+}
+
+// Writes a character at the cursor like the BIOS teletype. Bell, backspace, line feed and carriage return
+// move the cursor, the screen scrolls when the cursor moves past the bottom row
+void DOSEmulator::TeletypeCharacter(unsigned char character, int attribute)
+{
+    int columns = video_mode ? GRAPHICS_COLUMNS : TEXT_COLUMNS;
+    int rows = video_mode ? GRAPHICS_ROWS : TEXT_ROWS;
+    int column = vCursor->column;
+    int row = vCursor->row;
+
+    switch (character)
+    {
+    case '\a':
+        break;
+    case '\b':
+        column = std::max(column - 1, 0);
+        break;
+    case '\n':
+        row++;
+        break;
+    case '\r':
+        column = 0;
+        break;
+    default:
+        PutCharacter(character, attribute, column, row);
+        column++;
+        break;
+    }
+
+    if (column >= columns)
+    {
+        column = 0;
+        row++;
+    }
+
+    if (row >= rows)
+    {
+        ScrollScreen();
+        row = rows - 1;
+    }
+
+    vCursor->column = column;
+    vCursor->row = row;
+}
+
+// Writes DOS output to the screen at the cursor. Characters keep the attribute of the cell they land on,
+// DOS expands tabs to the next multiple of 8 columns
+void DOSEmulator::WriteTeletype(const unsigned char *text, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        if (text[i] != '\t')
+        {
+            TeletypeCharacter(text[i], -1);
+            continue;
+        }
+
+        do
+        {
+            TeletypeCharacter(' ', -1);
+        } while (vCursor->column % 8 != 0);
+    }
+}
+
+// Forgets every drawn cell so the whole text screen is drawn again with the next frame
+void DOSEmulator::InvalidateText()
+{
+    memset(glyph_keys, 0xff, sizeof(glyph_keys));
+    memset(text_shadow, 0xff, sizeof(text_shadow));
+
+    text_dirty_rows = (1u << TEXT_ROWS) - 1;
+    video_dirty = true;
+}
+
+// Gets the RGBA pixels of a cell, drawing them into the glyph cache when the character and attribute
+// aren't in it. The background uses the low 3 bits of the upper nibble, the blink bit is ignored
+const unsigned int *DOSEmulator::GlyphTile(unsigned int cell)
+{
+    unsigned int character = cell & 0xff;
+    unsigned int attribute = cell >> 8;
+    unsigned int slot = (character + attribute * 31) & (GLYPH_CACHE_SIZE - 1);
+    unsigned int *tile = glyph_tiles[slot];
+
+    if (glyph_keys[slot] == cell)
+        return tile;
+
+    glyph_keys[slot] = cell;
+
+    unsigned int foreground = palette[attribute & 0x0f];
+    unsigned int background = palette[(attribute >> 4) & 0x07];
+    const unsigned char *glyph = rom_font[character & 0x7f];
+
+    // The ROM font only has the first 128 characters, the rest are blank
+    for (int y = 0; y < GLYPH_HEIGHT; y++)
+    {
+        unsigned char bits = character < 128 ? glyph[y / 2] : 0;
+
+        for (int x = 0; x < GLYPH_WIDTH; x++)
+            tile[y * GLYPH_WIDTH + x] = (bits & (0x80 >> x)) ? foreground : background;
+    }
+
+    return tile;
+}
+
+// Draws the cells of a text row whose character or attribute changed since they were drawn last.
+// Returns if any did
+bool DOSEmulator::DrawTextRow(int row)
+{
+    const unsigned char *cells = memory + TEXT_MEMORY_START + row * TEXT_COLUMNS * 2;
+    bool changed = false;
+
+    for (int column = 0; column < TEXT_COLUMNS; column++)
+    {
+        unsigned int cell = cells[column * 2] | (cells[column * 2 + 1] << 8);
+        unsigned int *shadow = &text_shadow[row * TEXT_COLUMNS + column];
+
+        if (*shadow == cell)
+            continue;
+
+        *shadow = cell;
+        changed = true;
+
+        const unsigned int *tile = GlyphTile(cell);
+        unsigned int *target = frame_rgba + row * GLYPH_HEIGHT * FRAME_WIDTH + column * GLYPH_WIDTH;
+
+        for (int y = 0; y < GLYPH_HEIGHT; y++)
+            memcpy(target + y * FRAME_WIDTH, tile + y * GLYPH_WIDTH, GLYPH_WIDTH * 4);
+    }
+
+    return changed;
+}
+
+// Draws the changed cells of the rows stores went to and hands each run of redrawn rows to the host.
+// Returns the bytes handed over
+int DOSEmulator::PresentText()
+{
+    int bytes = 0;
+    int first = -1;
+
+    for (int row = 0; row <= TEXT_ROWS; row++)
+    {
+        if (row < TEXT_ROWS && (text_dirty_rows & (1u << row)) && DrawTextRow(row))
+        {
+            if (first < 0)
+                first = row;
+            continue;
+        }
+
+        if (first < 0)
+            continue;
+
+        present_rows(frame_rgba + first * GLYPH_HEIGHT * FRAME_WIDTH, first * GLYPH_HEIGHT, (row - first) * GLYPH_HEIGHT);
+
+        bytes += (row - first) * GLYPH_HEIGHT * FRAME_WIDTH * 4;
+        frame_stats.spans++;
+        first = -1;
+    }
+
+    return bytes;
+}
+
+// Gets the counters of the frames handed to the host
+FRAME_STATS DOSEmulator::GetFrameStats()
+{
+    return frame_stats;
+}
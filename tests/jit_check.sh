@@ -0,0 +1,72 @@
+#!/bin/sh
+# Runs the shipped examples and a self-modifying program under the interpreter, the JIT and the JIT
+# compiling every block on its first run, and fails when the printed output differs.
+# Usage: jit_check.sh <dos-emulator-headless> <examples directory>
+
+emulator=$1
+examples=$2
+work=$(mktemp -d)
+status=0
+
+trap 'rm -rf "$work"' EXIT
+
+# Writes each argument as one byte
+bytes()
+{
+    for byte in "$@"; do
+        printf "\\$(printf %03o "$byte")"
+    done
+}
+
+# A loop that stores the next digit into the immediate of an instruction a few bytes ahead of the
+# store and then prints it, compiled blocks have to stop at the store and run the new immediate
+{
+    # MZ header: 544 bytes in 2 blocks, 2 paragraphs of header, SS:SP 0:100, CS:IP 0:0
+    bytes 0x4d 0x5a 0x20 0x00 0x02 0x00 0x00 0x00 0x02 0x00 0x00 0x00 0xff 0xff 0x00 0x00
+    bytes 0x00 0x01 0x00 0x00 0x00 0x00 0x00 0x00 0x1c 0x00 0x00 0x00 0x00 0x00 0x00 0x00
+
+    bytes 0x0e 0x1f           # push cs; pop ds
+    bytes 0xb1 0x30           # mov cl, '0'
+    bytes 0x88 0x0e 0x09 0x00 # loop: mov [patch + 1], cl
+    bytes 0xb2 0x20           # patch: mov dl, ' '
+    bytes 0xb4 0x02 0xcd 0x21 # mov ah, 2; int 21h
+    bytes 0x41                # inc cx
+    bytes 0x80 0xf9 0x3a      # cmp cl, '9' + 1
+    bytes 0x75 0xf0           # jne loop
+    bytes 0xb8 0x00 0x4c      # mov ax, 4c00h
+    bytes 0xcd 0x21           # int 21h
+    head -c 487 /dev/zero
+} > "$work/SMC.EXE"
+
+# Runs a program in every mode with the same keys and compares the output to the interpreter's
+check()
+{
+    program=$1
+    keys=$2
+    name=$(basename "$program")
+
+    "$emulator" --keys "$keys" --limit 50000000 "$program" < /dev/null > "$work/$name.interpreter" 2> /dev/null
+    "$emulator" --jit --keys "$keys" --limit 50000000 "$program" < /dev/null > "$work/$name.jit" 2> /dev/null
+    "$emulator" --jit --threshold 1 --keys "$keys" --limit 50000000 "$program" < /dev/null > "$work/$name.threshold" 2> /dev/null
+
+    for mode in jit threshold; do
+        if ! diff "$work/$name.interpreter" "$work/$name.$mode" > "$work/$name.diff"; then
+            echo "$name: --$mode output differs from the interpreter"
+            cat "$work/$name.diff"
+            status=1
+        fi
+    done
+}
+
+check "$examples/HELLOM.EXE" ""
+check "$examples/TEST.EXE" ""
+check "$examples/KEY.EXE" "ab.x"
+check "$examples/PONG.EXE" "swwxsoolwwwwxxsslr"
+check "$work/SMC.EXE" ""
+
+if ! grep -q "0123456789" "$work/SMC.EXE.interpreter"; then
+    echo "SMC.EXE: the interpreter didn't print the patched digits"
+    status=1
+fi
+
+exit $status